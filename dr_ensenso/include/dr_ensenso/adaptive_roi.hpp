@@ -0,0 +1,75 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+
+#include <cstddef>
+#include <deque>
+
+namespace dr {
+
+/// Options for tracking an adaptive region of interest.
+struct AdaptiveRoiOptions {
+	/// The number of pixels added around the valid region on every side, so moving objects stay inside the region.
+	int margin = 32;
+
+	/// The number of previous frames whose valid regions are combined.
+	std::size_t history = 3;
+
+	/// Use the full bounds again after this many frames with a reduced region, to pick up objects that appeared outside the region. Zero disables refreshes.
+	std::size_t refresh_interval = 30;
+};
+
+/// Tracks the region of interest for the disparity map from the valid points of previous frames.
+/**
+ * For every frame, next() gives the region of interest to compute the disparity map in,
+ * and update() takes the region of the valid points of the resulting point map,
+ * as reported in PointCloudStatistics::region.
+ *
+ * The region of interest is the union of the valid regions of the last frames, grown by a margin and limited to the bounds.
+ * Periodically, and whenever no valid region is known, the full bounds are used.
+ */
+class AdaptiveRoi {
+	/// The options.
+	AdaptiveRoiOptions options;
+
+	/// The full image size.
+	cv::Size image_size;
+
+	/// The region the region of interest is limited to.
+	cv::Rect bounds;
+
+	/// The valid regions of the last frames, newest last.
+	std::deque<cv::Rect> regions;
+
+	/// The number of frames since the last full refresh.
+	std::size_t frames = 0;
+
+public:
+	/// Track a region of interest in an image of the given size.
+	explicit AdaptiveRoi(cv::Size image_size, AdaptiveRoiOptions const & options = AdaptiveRoiOptions());
+
+	/// Limit the region of interest to a part of the image, for example a projected workspace volume.
+	/**
+	 * This region is also used for refreshes. An empty rectangle resets the bounds to the full image.
+	 */
+	void setBounds(cv::Rect const & bounds);
+
+	/// Get the region the region of interest is limited to.
+	cv::Rect const & getBounds() const {
+		return bounds;
+	}
+
+	/// Get the region of interest for the next frame.
+	cv::Rect next();
+
+	/// Record the region of the valid points of the frame computed with the last region of interest.
+	/**
+	 * An empty region means the frame had no valid points, which triggers a refresh for the next frame.
+	 */
+	void update(cv::Rect const & valid_region);
+
+	/// Forget the valid regions of previous frames, so the next frame uses the full bounds.
+	void reset();
+};
+
+}
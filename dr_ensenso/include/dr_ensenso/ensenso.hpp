@@ -6,12 +6,165 @@
 
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
+#include <sensor_msgs/PointCloud2.h>
 
 #include <ensenso/nxLib.h>
 #include <boost/optional.hpp>
 
+#include "adaptive_roi.hpp"
+#include "pcl.hpp"
+#include "thread_pool.hpp"
+#include "util.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 namespace dr {
 
+/// Capture settings that are changed together, for example to switch between depth and intensity capture.
+/**
+ * Settings that are not set are left untouched.
+ */
+struct CaptureSettings {
+	/// The FlexView value, or -1 to disable FlexView.
+	boost::optional<int> flex_view;
+
+	/// The state of the projector.
+	boost::optional<bool> projector;
+
+	/// The state of the front light.
+	boost::optional<bool> front_light;
+};
+
+/// The outcome of retrieving data with a deadline.
+struct RetrieveResult {
+	enum class Status {
+		retrieved,     ///< New data was retrieved from all requested cameras.
+		not_triggered, ///< Triggering the cameras failed, so nothing was retrieved.
+		timed_out,     ///< The deadline passed before all requested cameras delivered new data.
+		cancelled,     ///< The retrieve was cancelled by Ensenso::cancelRetrieve().
+	};
+
+	/// The outcome.
+	Status status = Status::retrieved;
+
+	/// The time spent triggering and waiting for the data.
+	std::chrono::microseconds waited{0};
+
+	/// Check if new data was retrieved.
+	explicit operator bool() const {
+		return status == Status::retrieved;
+	}
+};
+
+/// Durations of the pipeline stages of the last frame.
+/**
+ * Retrieving new data starts a new frame and resets all durations to zero.
+ * Stages that did not run for the frame keep a duration of zero.
+ */
+struct StageTimings {
+	/// Retrieving (and optionally capturing) the images.
+	std::chrono::microseconds retrieve{0};
+
+	/// Rectifying the images for intensity images.
+	std::chrono::microseconds rectify{0};
+
+	/// Computing the disparity map, including setting the region of interest.
+	std::chrono::microseconds disparity{0};
+
+	/// Computing or rendering the point map.
+	std::chrono::microseconds point_map{0};
+
+	/// Converting the point map to a point cloud.
+	std::chrono::microseconds conversion{0};
+};
+
+/// The encoding of the point cloud of a Frame.
+enum class CloudEncoding {
+	xyz,      ///< Points with pcl::PointXYZ fields.
+	textured, ///< Points with pcl::PointXYZRGB fields when registered and pcl::PointXYZI fields otherwise.
+	compact,  ///< Points with INT16 millimeter coordinates, see toCompactPointCloud2.
+};
+
+/// Options for acquiring a frame with Ensenso::getFrame().
+struct FrameOptions {
+	/// The options for converting the point map to a point cloud.
+	PointCloudOptions cloud;
+
+	/// The encoding of the point cloud.
+	CloudEncoding encoding = CloudEncoding::xyz;
+
+	/// The region of interest for the point cloud.
+	cv::Rect roi;
+
+	/// If true, register the point cloud to the monocular camera.
+	bool registered = false;
+
+	/// If true, acquire an intensity image with the point cloud.
+	bool intensity = true;
+
+	/// If true and there is no monocular camera, take the intensity image from the same exposure as the point cloud.
+	/**
+	 * This saves a capture, but the projector pattern is visible in the intensity image.
+	 * Otherwise the intensity image gets its own capture with the projector and FlexView disabled.
+	 */
+	bool shared_exposure = false;
+
+	/// If true, turn on the front light for an intensity image that gets its own capture.
+	bool front_light = false;
+
+	/// If true, capture the monocular and stereo camera simultaneously.
+	/**
+	 * This saves a capture, but without hardware triggering the projector pattern may be visible in the monocular image.
+	 * Otherwise the monocular camera is captured before the stereo camera.
+	 */
+	bool synced = false;
+
+	/// The timeout in milliseconds for retrieving the images of each capture.
+	unsigned int timeout = 1500;
+
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/// A point cloud and intensity image acquired together by Ensenso::getFrame().
+struct Frame {
+	/// The point cloud.
+	sensor_msgs::PointCloud2 cloud;
+
+	/// The intensity image: the rectified left image without a monocular camera and the monocular image otherwise.
+	/**
+	 * Empty if no intensity image was requested.
+	 */
+	cv::Mat intensity;
+
+	/// The capture time of the point cloud in microseconds since January 1 1970 UTC.
+	std::int64_t cloud_timestamp = 0;
+
+	/// The capture time of the intensity image in microseconds since January 1 1970 UTC, or zero without intensity image.
+	std::int64_t intensity_timestamp = 0;
+
+	/// The number of captures used to acquire the frame.
+	unsigned int captures = 0;
+
+	/// True if the intensity image was captured by the same capture as the point cloud.
+	bool shared_exposure = false;
+
+	/// The durations of the pipeline stages, with the retrieve and rectify stages of all captures added up.
+	StageTimings timings;
+};
+
 class Ensenso {
 protected:
 	/// The root EnsensoSDK node.
@@ -23,13 +176,107 @@ protected:
 	/// The attached monocular camera node.
 	boost::optional<NxLibItem> monocular_camera;
 
+	/// The serial number of the stereo camera.
+	std::string serial;
+
+	/// The serial number of the monocular camera, or an empty string if there is no monocular camera.
+	std::string monocular_serial;
+
+	/// The point map node of the stereo camera.
+	NxLibItem point_map_item;
+
+	/// The rectified left image node of the stereo camera.
+	NxLibItem rectified_left_item;
+
+	/// The node of the point map rendered for the monocular camera.
+	NxLibItem render_point_map_item;
+
+	/// The region of interest last written to the tree, if it is known.
+	boost::optional<cv::Rect> applied_roi;
+
+	/// The capture settings as last read from or written to the tree. Unknown settings are not set.
+	CaptureSettings known_settings;
+
+	/// The loaded capture profiles as JSON trees of camera parameters, by name.
+	std::map<std::string, std::string> capture_profiles;
+
+	/// The name of the active capture profile, or an empty string if the parameters changed since activating one.
+	std::string active_profile;
+
+	/// The durations of the pipeline stages of the last frame.
+	mutable StageTimings stage_timings;
+
+	/// If true, OpenGL has been disabled for rendering point maps.
+	bool render_prepared = false;
+
+	/// Tracker for the region of interest of the disparity map, or null if the region of interest is not adaptive.
+	std::unique_ptr<AdaptiveRoi> adaptive_roi;
+
+	/// If true, the last disparity map was computed in the region of interest given by the tracker.
+	bool tracking_region = false;
+
+	/// The region of interest covering the workspace volume, or an empty rectangle if no workspace volume is set.
+	cv::Rect workspace_roi;
+
+	/// The minimum disparity and number of disparities covering the workspace volume, if a workspace volume is set.
+	/**
+	 * Not part of the parameter cache: it is applied again whenever parameters or a capture profile are loaded.
+	 */
+	boost::optional<std::pair<int, int>> workspace_disparity_range;
+
+	/// The minimum disparity and number of disparities of the loaded parameters, restored when the workspace volume is cleared.
+	boost::optional<std::pair<int, int>> default_disparity_range;
+
+	/// Prepared commands for the per-frame command sequence.
+	std::unique_ptr<PreparedNxCommand> trigger_command;
+	std::unique_ptr<PreparedNxCommand> capture_command;
+	std::unique_ptr<PreparedNxCommand> retrieve_command;
+	std::unique_ptr<PreparedNxCommand> rectify_command;
+	std::unique_ptr<PreparedNxCommand> disparity_command;
+	std::unique_ptr<PreparedNxCommand> point_map_command;
+	std::unique_ptr<PreparedNxCommand> render_command;
+
+	/// Set by cancelRetrieve() and cleared by resumeRetrieve(). While set, retrieveUntil() returns without waiting for data.
+	std::atomic<bool> retrieve_cancelled{false};
+
+	/// If true, the stereo camera has a capture that a retrieve gave up on, which must be collected before triggering again.
+	mutable bool pending_stereo = false;
+
+	/// If true, the monocular camera has a capture that a retrieve gave up on, which must be collected before triggering again.
+	mutable bool pending_monocular = false;
+
+	/// The thread pool for point cloud conversions, or null to use defaultThreadPool().
+	std::unique_ptr<ThreadPool> thread_pool;
+
+	/// Thread running the asynchronous operations, started on the first asynchronous call.
+	std::thread async_thread;
+
+	/// Mutex protecting the queue of asynchronous operations.
+	std::mutex async_mutex;
+
+	/// Condition signalled when an asynchronous operation is queued or the camera is destroyed.
+	std::condition_variable async_condition;
+
+	/// Asynchronous operations waiting to be executed, in the order they were requested.
+	std::deque<std::function<void()>> async_queue;
+
+	/// If true, the async thread finishes the queued operations and stops.
+	bool async_stop = false;
+
 public:
 	/// Ensenso calibration result (camera pose, pattern pose, iterations needed, reprojection error).
 	using CalibrationResult = std::tuple<Eigen::Isometry3d, Eigen::Isometry3d, int, double>;
 
 	/// Connect to an ensenso camera.
+	/**
+	 * The NxLib is initialized when the first camera is created and finalized when the last one is destroyed,
+	 * so multiple cameras can be used at the same time.
+	 */
 	Ensenso(std::string serial = "", bool connect_monocular = true);
 
+	Ensenso(Ensenso const &) = delete;
+	Ensenso & operator=(Ensenso const &) = delete;
+
 	/// Destructor.
 	~Ensenso();
 
@@ -54,14 +301,46 @@ public:
 	}
 
 	/// Get the serial number of the stereo camera.
-	std::string serialNumber() const;
+	std::string const & serialNumber() const {
+		return serial;
+	}
 
 	/// Get the serial number of the monocular camera or an empty string if there is no monocular camera.
-	std::string monocularSerialNumber() const;
+	std::string const & monocularSerialNumber() const {
+		return monocular_serial;
+	}
 
 	/// Loads the camera parameters from a JSON file.
 	bool loadParameters(std::string const parameters_file);
 
+	/// Loads a named capture profile from a JSON file with (a subset of) the camera parameters.
+	/**
+	 * The profile is validated by applying it once, after which the previous parameters are restored.
+	 * Loading a profile with the name of an existing profile replaces it.
+	 *
+	 * \return False if the file was not found.
+	 * \throw NxError if the profile can not be applied to the camera.
+	 */
+	bool loadCaptureProfile(std::string const & name, std::string const & parameters_file);
+
+	/// Activate a capture profile with a single tree update.
+	/**
+	 * Activating the profile that is already active does nothing,
+	 * unless the parameters were changed through this object since it was activated.
+	 *
+	 * \throw std::runtime_error if no profile with the given name is loaded.
+	 * \throw NxError if applying the profile fails.
+	 */
+	void activateCaptureProfile(std::string const & name);
+
+	/// Get the name of the active capture profile, or an empty string if no profile is active.
+	std::string const & activeCaptureProfile() const {
+		return active_profile;
+	}
+
+	/// Get the names of the loaded capture profiles.
+	std::vector<std::string> captureProfiles() const;
+
 	/// Loads the monocular camera parameters from a JSON file. Returns false if file was not found.
 	bool loadMonocularParameters(std::string const parameters_file);
 
@@ -80,8 +359,24 @@ public:
 	/// Sets the projector on or off.
 	void setProjector(bool state);
 
+	/// Get the current values of the capture settings that are set in settings.
+	/**
+	 * Values are cached, so they are only read from the tree the first time.
+	 * \return The current values of the requested settings.
+	 */
+	CaptureSettings captureSettings(CaptureSettings const & settings);
+
+	/// Apply capture settings.
+	/**
+	 * Only the settings that differ from the current state are written, in a single tree update.
+	 */
+	void applyCaptureSettings(CaptureSettings const & settings);
+
 	/// Trigger data acquisition on the camera.
 	/**
+	 * A capture left pending by a retrieveUntil() that timed out or was cancelled is collected and discarded first,
+	 * waiting at most a second for it. The wait can be cut short by cancelRetrieve().
+	 *
 	 * \param stereo If true, capture data from the stereo camera.
 	 * \param monocular If true, capture data from the monocular camera.
 	 */
@@ -89,35 +384,236 @@ public:
 
 	/// Retrieve new data from the camera without sending a software trigger.
 	/**
+	 * When triggering, a capture left pending by a retrieveUntil() that timed out or was cancelled is collected and discarded first, within the timeout.
+	 * Without triggering, such a pending capture is the data that is retrieved.
+	 *
 	 * \param timeout A timeout in milliseconds.
 	 * \param stereo If true, capture data from the stereo camera.
 	 * \param monocular If true, capture data from the monocular camera.
 	 */
 	bool retrieve(bool trigger = true, unsigned int timeout = 1500, bool stereo = true, bool monocular=true) const;
 
+	/// Retrieve new data from the camera, waiting at most until a deadline.
+	/**
+	 * Instead of blocking for the full timeout, the camera is polled in short slices,
+	 * so the wait can be cut short by cancelRetrieve() from another thread.
+	 * Cameras that delivered their data in an earlier slice are not retrieved again.
+	 *
+	 * The call returns at most one slice after a cancellation, and shortly after the deadline:
+	 * the last poll waits only for the time remaining until the deadline, so the overrun is the time NxLib takes to execute a poll.
+	 *
+	 * When the retrieve times out or is cancelled, it does not wait for the capture that is still on its way.
+	 * The capture is remembered instead and collected and discarded before the next trigger,
+	 * within the deadline or timeout of that call, so it does not end up in the next retrieve.
+	 * Calling retrieveUntil() or retrieve() without triggering continues to wait for the pending capture instead.
+	 * If a pending capture can not be collected before the deadline, the result is timed_out or cancelled without triggering.
+	 *
+	 * \param deadline The time after which to stop waiting. If it already passed, the cameras are polled once without waiting.
+	 * \param trigger If true, trigger the cameras before waiting for the data.
+	 * \param stereo If true, retrieve data from the stereo camera.
+	 * \param monocular If true, retrieve data from the monocular camera.
+	 * \param slice The longest time to wait for the camera before checking for cancellation again.
+	 * \return The outcome and the time spent waiting.
+	 * \throw NxError if triggering or retrieving fails.
+	 */
+	RetrieveResult retrieveUntil(
+		std::chrono::steady_clock::time_point deadline,
+		bool trigger = true,
+		bool stereo = true,
+		bool monocular = true,
+		std::chrono::milliseconds slice = std::chrono::milliseconds(50)
+	) const;
+
+	/// Cancel the calls to retrieveUntil() that are waiting for data, on any thread.
+	/**
+	 * The cancellation stays in effect until resumeRetrieve() is called,
+	 * so calls to retrieveUntil() that start afterwards are cancelled as well, without triggering the camera.
+	 * This way a cancellation can not be missed by a retrieve that is just about to start.
+	 */
+	void cancelRetrieve() {
+		retrieve_cancelled = true;
+	}
+
+	/// Allow retrieveUntil() to wait for data again after cancelRetrieve().
+	/**
+	 * Call this when taking over the camera, before the first retrieve.
+	 */
+	void resumeRetrieve() {
+		retrieve_cancelled = false;
+	}
+
+	/// Capture new data asynchronously.
+	/**
+	 * The camera is triggered immediately on the calling thread,
+	 * but the images are retrieved on the async thread after all previously requested asynchronous operations finished.
+	 * This allows the exposure and transfer of the next frame to overlap with loading the point cloud of the current frame:
+	 *
+	 *     camera.captureAsync().get();
+	 *     while (running) {
+	 *         std::future<void> cloud = camera.loadPointCloudAsync(current);
+	 *         std::future<bool> next  = camera.captureAsync();
+	 *         cloud.get();
+	 *         process(current);
+	 *         next.get();
+	 *     }
+	 *
+	 * The previous capture must have been retrieved before triggering the camera again.
+	 * Synchronous operations on the camera should not be mixed with pending asynchronous operations.
+	 *
+	 * \param timeout A timeout in milliseconds for retrieving the images.
+	 * \param stereo If true, capture data from the stereo camera.
+	 * \param monocular If true, capture data from the monocular camera.
+	 * \return A future holding the result of the capture, or the exception thrown while retrieving the images.
+	 * \throw NxError if triggering the camera fails.
+	 */
+	std::future<bool> captureAsync(unsigned int timeout = 1500, bool stereo = true, bool monocular = true);
+
 	/// Rectifies the images.
 	void rectifyImages();
 
+	/// Compute the disparity map of the last retrieved images.
+	/**
+	 * This is the second stage of loading a point cloud, after retrieve().
+	 * It also rectifies the images.
+	 *
+	 * \param roi The region of interest. If empty and an adaptive region of interest is enabled, the region given by the tracker.
+	 */
+	void computeDisparityMap(cv::Rect roi = cv::Rect());
+
+	/// Compute the point map from the last disparity map.
+	/**
+	 * This is the third stage of loading a point cloud, after computeDisparityMap().
+	 */
+	void computePointMap();
+
+	/// Render the point map from the last disparity map from the view point of the monocular camera.
+	/**
+	 * This is the third stage of loading a registered point cloud, after computeDisparityMap().
+	 */
+	void renderPointMap();
+
+	/// Convert the last point map to a point cloud.
+	/**
+	 * This is the last stage of loading a point cloud, after computePointMap() or renderPointMap().
+	 *
+	 * \param cloud the resulting pointcloud.
+	 * \param registered If true, convert the point map rendered by renderPointMap().
+	 * \param options The options for converting the point map to a point cloud.
+	 * \param indices If not null, receives the index in the point map of each point, as described for toPointCloud.
+	 */
+	template<typename Point>
+	void convertPointCloud(
+		pcl::PointCloud<Point> & cloud,
+		bool registered = false,
+		PointCloudOptions const & options = PointCloudOptions(),
+		std::vector<int> * indices = nullptr
+	);
+
+	/// Convert the last point map directly to a PointCloud2 message.
+	/**
+	 * See convertPointCloud for pcl point clouds.
+	 */
+	template<typename Point>
+	void convertPointCloud(
+		sensor_msgs::PointCloud2 & cloud,
+		bool registered = false,
+		PointCloudOptions const & options = PointCloudOptions(),
+		std::vector<int> * indices = nullptr
+	);
+
+	/// Convert the last point map to a compact PointCloud2 message with millimeter precision.
+	/**
+	 * See convertPointCloud for the parameters and toCompactPointCloud2 for the encoding.
+	 */
+	void convertCompactPointCloud(
+		sensor_msgs::PointCloud2 & cloud,
+		bool registered = false,
+		PointCloudOptions const & options = PointCloudOptions(),
+		std::vector<int> * indices = nullptr
+	);
+
+	/// Enable or disable the adaptive region of interest for the disparity map.
+	/**
+	 * When enabled, point maps loaded without an explicit region of interest are computed
+	 * only in the region around the valid points of the previous frames, see AdaptiveRoi.
+	 * The tracker learns from point clouds converted with registered set to false.
+	 * Registered point maps are rendered in the view of the monocular camera and do not update the tracker,
+	 * so when only registered point clouds are loaded, the full bounds are used for every frame.
+	 *
+	 * \param options The options of the tracker, or none to disable the adaptive region of interest.
+	 */
+	void setAdaptiveRoi(boost::optional<AdaptiveRoiOptions> const & options);
+
+	/// Get the tracker of the adaptive region of interest, or null if it is disabled.
+	AdaptiveRoi * adaptiveRoi() {
+		return adaptive_roi.get();
+	}
+
+	/// Get the durations of the pipeline stages of the last frame.
+	/**
+	 * The timings are not synchronized, so they should be read by the thread running the stages.
+	 */
+	StageTimings const & stageTimings() const {
+		return stage_timings;
+	}
+
+	/// Set the number of threads used to convert point maps to point clouds.
+	/**
+	 * The camera gets its own thread pool, which is used unless the conversion options specify a thread pool.
+	 * \param threads The number of threads, or zero to use the thread pool shared by all cameras.
+	 */
+	void setConversionThreads(std::size_t threads);
+
 	/// Returns the size of the intensity images.
+	/**
+	 * If no image has been captured yet, the size is derived from the sensor size and binning.
+	 */
 	cv::Size getIntensitySize();
 
+	/// Returns the OpenCV type of the intensity images.
+	int getIntensityType();
+
 	/// Returns the size of the depth images.
+	/**
+	 * If no point map has been computed yet, the size is derived from the sensor size and binning.
+	 */
 	cv::Size getPointCloudSize();
 
 	/// Loads the intensity image to intensity.
 	/**
+	 * The data of intensity is reused if it already has the right size and type.
+	 * Use an image from an ImagePool to avoid overwriting images that are still in use.
+	 * Waiting for a new image can be cut short by cancelRetrieve().
 	 * \param capture If true, capture a new image before loading the point cloud.
+	 * \param timeout A timeout in milliseconds for capturing a new image.
+	 * \return The outcome of capturing a new image, or a retrieved result if capture is false. If no new image was retrieved, intensity is left unchanged.
+	 * \throw NxError on failure.
 	 */
-	void loadIntensity(cv::Mat & intensity, bool capture);
+	RetrieveResult loadIntensity(cv::Mat & intensity, bool capture, unsigned int timeout = 1500);
 
 	/// Loads the intensity image to intensity.
-	void loadIntensity(cv::Mat & intensity) {
-		loadIntensity(intensity, true);
+	RetrieveResult loadIntensity(cv::Mat & intensity) {
+		return loadIntensity(intensity, true);
 	}
 
+	/// Acquire a point cloud and intensity image together with as few captures as the options allow.
+	/**
+	 * Without a monocular camera, the intensity image needs a capture with the projector disabled, unless options.shared_exposure is set.
+	 * With a monocular camera, the monocular camera is captured separately, unless options.synced is set.
+	 * In all other cases the whole frame is acquired with a single capture.
+	 *
+	 * The data of frame is reused where possible. Use an image from an ImagePool for the intensity image to avoid overwriting images that are still in use.
+	 *
+	 * \param frame The resulting frame. Only complete if new data was retrieved.
+	 * \param options The options for acquiring the frame.
+	 * \return The outcome of the first retrieve that failed, or of the last retrieve, with the time spent waiting for all captures.
+	 * \throw NxError on failure.
+	 */
+	RetrieveResult getFrame(Frame & frame, FrameOptions const & options = FrameOptions());
+
 	/// Get the intensity image.
 	/**
-	 * \return The intensity image.
+	 * \return The intensity image, or an empty image if no new image was retrieved.
 	 */
 	cv::Mat getIntensity() {
 		cv::Mat intensity;
@@ -127,21 +623,65 @@ public:
 
 	/// Loads the pointcloud from depth in the region of interest.
 	/**
+	 * For pcl::PointXYZI and pcl::PointXYZRGB the points are textured with the rectified left image.
+	 * Supported point types are pcl::PointXYZ, pcl::PointXYZI and pcl::PointXYZRGB.
+	 *
 	 * \param cloud the resulting pointcloud.
 	 * \param roi The region of interest.
 	 * \param capture If true, capture a new image before loading the point cloud.
 	 */
-	void loadPointCloud(pcl::PointCloud<pcl::PointXYZ> & cloud, cv::Rect roi, bool capture);
+	template<typename Point>
+	void loadPointCloud(pcl::PointCloud<Point> & cloud, cv::Rect roi, bool capture) {
+		loadPointCloud(cloud, PointCloudOptions(), roi, capture);
+	}
+
+	/// Loads the pointcloud from depth in the region of interest with the given conversion options.
+	/**
+	 * \param cloud the resulting pointcloud.
+	 * \param options The options for converting the point map to a point cloud.
+	 * \param roi The region of interest.
+	 * \param capture If true, capture a new image before loading the point cloud.
+	 * \param indices If not null, receives the index in the point map of each point, as described for toPointCloud.
+	 */
+	template<typename Point>
+	void loadPointCloud(
+		pcl::PointCloud<Point> & cloud,
+		PointCloudOptions const & options,
+		cv::Rect roi = cv::Rect(),
+		bool capture = true,
+		std::vector<int> * indices = nullptr
+	);
 
 	/// Loads the pointcloud from depth in the region of interest.
 	/**
 	 * \param cloud the resulting pointcloud.
 	 * \param roi The region of interest.
 	 */
-	void loadPointCloud(pcl::PointCloud<pcl::PointXYZ> & cloud, cv::Rect roi = cv::Rect()) {
+	template<typename Point>
+	void loadPointCloud(pcl::PointCloud<Point> & cloud, cv::Rect roi = cv::Rect()) {
 		return loadPointCloud(cloud, roi, true);
 	}
 
+	/// Loads the pointcloud from depth directly into a PointCloud2 message.
+	/**
+	 * The message gets the fields and memory layout that pcl::toROSMsg would produce for the given PCL point type,
+	 * but the points are written straight into the data buffer of the message.
+	 *
+	 * \param cloud the resulting pointcloud.
+	 * \param options The options for converting the point map to a point cloud.
+	 * \param roi The region of interest.
+	 * \param capture If true, capture a new image before loading the point cloud.
+	 * \param indices If not null, receives the index in the point map of each point, as described for toPointCloud.
+	 */
+	template<typename Point>
+	void loadPointCloud(
+		sensor_msgs::PointCloud2 & cloud,
+		PointCloudOptions const & options = PointCloudOptions(),
+		cv::Rect roi = cv::Rect(),
+		bool capture = true,
+		std::vector<int> * indices = nullptr
+	);
+
 	/// Get a pointlcoud from the camera.
 	/**
 	 * \param roi The region of interest.
@@ -154,12 +694,145 @@ public:
 	}
 
 	/// Loads the pointcloud registered to the monocular camera.
+	/**
+	 * For pcl::PointXYZI and pcl::PointXYZRGB the points are textured with the image of the monocular camera,
+	 * so these point types throw std::runtime_error if there is no monocular camera.
+	 * Supported point types are pcl::PointXYZ, pcl::PointXYZI and pcl::PointXYZRGB.
+	 *
+	 * \param cloud the resulting pointcloud.
+	 * \param roi The region of interest.
+	 * \param capture If true, capture a new image before loading the point cloud.
+	 */
+	template<typename Point>
+	void loadRegisteredPointCloud(pcl::PointCloud<Point> & cloud, cv::Rect roi = cv::Rect(), bool capture = true) {
+		loadRegisteredPointCloud(cloud, PointCloudOptions(), roi, capture);
+	}
+
+	/// Loads the pointcloud registered to the monocular camera with the given conversion options.
 	/**
 	 * \param cloud the resulting pointcloud.
+	 * \param options The options for converting the point map to a point cloud.
 	 * \param roi The region of interest.
 	 * \param capture If true, capture a new image before loading the point cloud.
+	 * \param indices If not null, receives the index in the point map of each point, as described for toPointCloud.
 	 */
-	void loadRegisteredPointCloud(pcl::PointCloud<pcl::PointXYZ> & cloud, cv::Rect roi = cv::Rect(), bool capture = true);
+	template<typename Point>
+	void loadRegisteredPointCloud(
+		pcl::PointCloud<Point> & cloud,
+		PointCloudOptions const & options,
+		cv::Rect roi = cv::Rect(),
+		bool capture = true,
+		std::vector<int> * indices = nullptr
+	);
+
+	/// Loads the pointcloud registered to the monocular camera directly into a PointCloud2 message.
+	/**
+	 * The message gets the fields and memory layout that pcl::toROSMsg would produce for the given PCL point type,
+	 * but the points are written straight into the data buffer of the message.
+	 *
+	 * \param cloud the resulting pointcloud.
+	 * \param options The options for converting the point map to a point cloud.
+	 * \param roi The region of interest.
+	 * \param capture If true, capture a new image before loading the point cloud.
+	 * \param indices If not null, receives the index in the point map of each point, as described for toPointCloud.
+	 */
+	template<typename Point>
+	void loadRegisteredPointCloud(
+		sensor_msgs::PointCloud2 & cloud,
+		PointCloudOptions const & options = PointCloudOptions(),
+		cv::Rect roi = cv::Rect(),
+		bool capture = true,
+		std::vector<int> * indices = nullptr
+	);
+
+	/// Asynchronously loads the pointcloud from depth in the region of interest.
+	/**
+	 * The point cloud is loaded on the async thread after all previously requested asynchronous operations finished.
+	 * The cloud and indices must stay valid until the returned future is ready.
+	 *
+	 * Unlike loadPointCloud, no new data is captured by default, since this is meant to be combined with captureAsync.
+	 *
+	 * \return A future that becomes ready when the point cloud is loaded, holding any exception thrown while loading it.
+	 */
+	template<typename Point>
+	std::future<void> loadPointCloudAsync(
+		pcl::PointCloud<Point> & cloud,
+		PointCloudOptions const & options = PointCloudOptions(),
+		cv::Rect roi = cv::Rect(),
+		bool capture = false,
+		std::vector<int> * indices = nullptr
+	) {
+		std::shared_ptr<PointCloudOptions> copy(new PointCloudOptions(options));
+		return runAsync([this, &cloud, copy, roi, capture, indices] () { loadPointCloud(cloud, *copy, roi, capture, indices); });
+	}
+
+	/// Asynchronously loads the pointcloud from depth directly into a PointCloud2 message.
+	/**
+	 * See loadPointCloudAsync for pcl point clouds.
+	 */
+	template<typename Point>
+	std::future<void> loadPointCloudAsync(
+		sensor_msgs::PointCloud2 & cloud,
+		PointCloudOptions const & options = PointCloudOptions(),
+		cv::Rect roi = cv::Rect(),
+		bool capture = false,
+		std::vector<int> * indices = nullptr
+	) {
+		std::shared_ptr<PointCloudOptions> copy(new PointCloudOptions(options));
+		return runAsync([this, &cloud, copy, roi, capture, indices] () { loadPointCloud<Point>(cloud, *copy, roi, capture, indices); });
+	}
+
+	/// Asynchronously loads the pointcloud registered to the monocular camera.
+	/**
+	 * See loadPointCloudAsync.
+	 */
+	template<typename Point>
+	std::future<void> loadRegisteredPointCloudAsync(
+		pcl::PointCloud<Point> & cloud,
+		PointCloudOptions const & options = PointCloudOptions(),
+		cv::Rect roi = cv::Rect(),
+		bool capture = false,
+		std::vector<int> * indices = nullptr
+	) {
+		std::shared_ptr<PointCloudOptions> copy(new PointCloudOptions(options));
+		return runAsync([this, &cloud, copy, roi, capture, indices] () { loadRegisteredPointCloud(cloud, *copy, roi, capture, indices); });
+	}
+
+	/// Loads the pointcloud from depth into a compact PointCloud2 message with millimeter precision.
+	/**
+	 * See toCompactPointCloud2 for the encoding, and fromCompactPointCloud2 to decode it.
+	 *
+	 * \param cloud the resulting pointcloud.
+	 * \param options The options for converting the point map to a point cloud.
+	 * \param roi The region of interest.
+	 * \param capture If true, capture a new image before loading the point cloud.
+	 * \param indices If not null, receives the index in the point map of each point, as described for toPointCloud.
+	 */
+	void loadCompactPointCloud(
+		sensor_msgs::PointCloud2 & cloud,
+		PointCloudOptions const & options = PointCloudOptions(),
+		cv::Rect roi = cv::Rect(),
+		bool capture = true,
+		std::vector<int> * indices = nullptr
+	);
+
+	/// Loads the pointcloud registered to the monocular camera into a compact PointCloud2 message with millimeter precision.
+	/**
+	 * See toCompactPointCloud2 for the encoding, and fromCompactPointCloud2 to decode it.
+	 *
+	 * \param cloud the resulting pointcloud.
+	 * \param options The options for converting the point map to a point cloud.
+	 * \param roi The region of interest.
+	 * \param capture If true, capture a new image before loading the point cloud.
+	 * \param indices If not null, receives the index in the point map of each point, as described for toPointCloud.
+	 */
+	void loadRegisteredCompactPointCloud(
+		sensor_msgs::PointCloud2 & cloud,
+		PointCloudOptions const & options = PointCloudOptions(),
+		cv::Rect roi = cv::Rect(),
+		bool capture = true,
+		std::vector<int> * indices = nullptr
+	);
 
 	/// Discards all stored calibration patterns.
 	void discardCalibrationPatterns();
@@ -212,10 +885,133 @@ public:
 	/// Stores the active workspace caliration on the EEPROM of the camera.
 	void storeWorkspaceCalibration();
 
+	/// Limit stereo matching to the part of the view that can contain points in a box.
+	/**
+	 * The corners of the box are projected through the stereo calibration into the rectified left image.
+	 * Their bounding box becomes the default region of interest for the disparity map,
+	 * used when no region of interest is given and as bounds for the adaptive region of interest.
+	 * The disparity range of stereo matching is set to the depth extent of the box.
+	 *
+	 * The box is projected with the workspace calibration at the time of the call.
+	 * The disparity range stays in effect when parameters are loaded or a capture profile is activated afterwards.
+	 *
+	 * \param volume The box in meters, in the calibrated frame if the camera has a workspace calibration, otherwise in the camera frame.
+	 * \return The region of interest covering the box.
+	 * \throw std::runtime_error if the box is empty, not entirely in front of the camera, or outside the view.
+	 * \throw NxError if reading the calibration or setting the parameters fails.
+	 */
+	cv::Rect setWorkspaceVolume(Eigen::AlignedBox3d const & volume);
+
+	/// Stop limiting stereo matching to a workspace volume and restore the previous disparity range.
+	void clearWorkspaceVolume();
+
 protected:
+	/// Run a function on the async thread after all previously requested asynchronous operations.
+	/**
+	 * \return A future holding the result of the function or the exception it threw.
+	 */
+	template<typename F>
+	std::future<typename std::result_of<F()>::type> runAsync(F function) {
+		using Result = typename std::result_of<F()>::type;
+		std::shared_ptr<std::packaged_task<Result()>> task = std::make_shared<std::packaged_task<Result()>>(std::move(function));
+		std::future<Result> result = task->get_future();
+		queueAsync([task] () { (*task)(); });
+		return result;
+	}
+
+	/// Add an operation to the async queue, starting the async thread if needed.
+	void queueAsync(std::function<void()> operation);
+
+	/// Execute queued asynchronous operations until the camera is destroyed.
+	void asyncLoop();
+
+	/// Run a capture or retrieve command for the given cameras.
+	/**
+	 * \param stereo If true, retrieve data from the stereo camera. Cleared if the data was retrieved.
+	 * \param monocular If true, retrieve data from the monocular camera. Cleared if the data was retrieved.
+	 */
+	void executeRetrieve(PreparedNxCommand & command, unsigned int timeout, bool & stereo, bool & monocular) const;
+
+	/// Collect and discard the captures that a retrieve gave up on, polling in slices so it can be cancelled.
+	/**
+	 * \return True if nothing is pending anymore, false if the deadline passed or the wait was cancelled first.
+	 */
+	bool collectPendingCapture(std::chrono::steady_clock::time_point deadline, std::chrono::milliseconds slice = std::chrono::milliseconds(50)) const;
+
+	/// Forget the cached state of the camera parameters, after they may have been changed as a whole.
+	void invalidateParameterCache();
+
+	/// Apply the disparity range of the workspace volume again after parameters were loaded, if a workspace volume is set.
+	/**
+	 * The loaded disparity range becomes the range to restore when the workspace volume is cleared.
+	 */
+	void reapplyWorkspaceVolume();
+
+	/// Get the conversion options with the thread pool of the camera filled in, unless the options specify one.
+	PointCloudOptions conversionOptions(PointCloudOptions options) const;
+
+	/// Run a point map conversion and feed the valid region of the result to the adaptive region of interest, if it gave the region of the point map.
+	/**
+	 * \param convert Function performing the conversion with the given options.
+	 */
+	template<typename Convert>
+	void convertTracked(bool registered, PointCloudOptions const & options, Convert const & convert);
+
 	/// Set the region of interest for the disparity map (and thereby depth / point cloud).
+	/**
+	 * The tree is only updated when the region of interest differs from the last one that was set.
+	 */
 	void setRegionOfInterest(cv::Rect const & roi);
 
+	/// Open the stereo camera with the given serial, or the first stereo camera if the serial is empty, and its linked monocular camera.
+	void open(std::string const & serial, bool connect_monocular);
+
+	/// Optionally capture new data and compute the disparity map and point map.
+	void loadPointMap(cv::Rect roi, bool capture);
+
+	/// Optionally capture new data, compute the disparity map and render the point map for the monocular camera.
+	void loadRegisteredPointMap(cv::Rect roi, bool capture);
+
+	/// Get the texture for the (registered) point map, or an empty image if no texture is needed.
+	/**
+	 * \throw std::runtime_error if a registered point map needs a texture but there is no monocular camera.
+	 */
+	cv::Mat pointMapTexture(bool registered, bool textured);
+
+};
+
+/// Applies capture settings for the lifetime of the object and restores the previous settings afterwards.
+/**
+ * Both applying and restoring write only the settings that change, in a single tree update.
+ */
+class ScopedCaptureSettings {
+	/// The camera.
+	Ensenso & ensenso;
+
+	/// The settings to restore.
+	CaptureSettings previous;
+
+public:
+	/// Apply capture settings to a camera.
+	/**
+	 * \throw NxError if reading or applying the settings fails.
+	 */
+	ScopedCaptureSettings(Ensenso & ensenso, CaptureSettings const & settings) :
+		ensenso(ensenso),
+		previous(ensenso.captureSettings(settings))
+	{
+		ensenso.applyCaptureSettings(settings);
+	}
+
+	/// Restore the previous settings. Errors while restoring are ignored, since this may run during stack unwinding.
+	~ScopedCaptureSettings() {
+		try {
+			ensenso.applyCaptureSettings(previous);
+		} catch (...) {}
+	}
+
+	ScopedCaptureSettings(ScopedCaptureSettings const &) = delete;
+	ScopedCaptureSettings & operator=(ScopedCaptureSettings const &) = delete;
 };
 
 }
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "ensenso.hpp"
+#include "pcl.hpp"
+#include "thread_pool.hpp"
+#include "util.hpp"
+
+#include <opencv2/core/core.hpp>
+#include <pcl/point_cloud.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace dr {
+
+/// A group of Ensenso cameras that are captured together.
+/**
+ * All cameras of the group are captured by a single capture command,
+ * after which per-camera work such as computing the disparity maps runs in parallel with a thread per camera.
+ * The cycle time of the group is then close to that of a single camera.
+ */
+class EnsensoGroup {
+protected:
+	/// The cameras in the group.
+	std::vector<std::unique_ptr<Ensenso>> cameras;
+
+	/// Thread pool with a thread for each camera.
+	std::unique_ptr<ThreadPool> pool;
+
+	/// The capture command for all cameras in the group.
+	std::unique_ptr<PreparedNxCommand> capture_command;
+
+	/// Mutex serializing the rendering and conversion of registered point maps.
+	/**
+	 * All cameras render into the same global /Images/RenderPointMap node with the same /Parameters/RenderPointMap,
+	 * so a camera must convert its rendered point map before the next camera renders.
+	 */
+	std::mutex render_mutex;
+
+public:
+	/// Open a group of stereo cameras.
+	/**
+	 * \param serials The serial numbers of the stereo cameras.
+	 * \param connect_monocular If true, also open the monocular cameras linked to the stereo cameras.
+	 * \throw std::runtime_error if no serials are given or a camera can not be found.
+	 * \throw NxError if opening a camera fails.
+	 */
+	explicit EnsensoGroup(std::vector<std::string> const & serials, bool connect_monocular = true);
+
+	EnsensoGroup(EnsensoGroup const &) = delete;
+	EnsensoGroup & operator=(EnsensoGroup const &) = delete;
+
+	/// Get the number of cameras in the group.
+	std::size_t size() const {
+		return cameras.size();
+	}
+
+	/// Get a camera of the group.
+	Ensenso & camera(std::size_t index) {
+		return *cameras[index];
+	}
+
+	/// Get a camera of the group.
+	Ensenso const & camera(std::size_t index) const {
+		return *cameras[index];
+	}
+
+	/// Capture new data from all cameras with a single capture command.
+	/**
+	 * \param timeout A timeout in milliseconds.
+	 * \param stereo If true, capture data from the stereo cameras.
+	 * \param monocular If true, capture data from the monocular cameras.
+	 * \return True if data was retrieved from all cameras.
+	 * \throw NxError on failure.
+	 */
+	bool capture(unsigned int timeout = 1500, bool stereo = true, bool monocular = true);
+
+	/// Run a function for every camera in parallel and wait for all of them to finish.
+	/**
+	 * If the function throws for some camera, the other cameras are still processed and the first exception is rethrown.
+	 */
+	void forEach(std::function<void (Ensenso & camera, std::size_t index)> const & function);
+
+	/// Load the point clouds of all cameras, computing and converting them in parallel.
+	/**
+	 * See Ensenso::loadPointCloud for supported point types.
+	 *
+	 * \param clouds The resulting point clouds, one for each camera. Point clouds that are null are allocated.
+	 * \param options The options for converting the point maps to point clouds.
+	 * \param registered If true, load the point clouds registered to the monocular cameras.
+	 *                   The disparity maps are still computed in parallel, but rendering and converting the registered point maps is done one camera at a time.
+	 * \param capture If true, capture new data from all cameras before loading the point clouds.
+	 * \return False if capturing new data failed, true otherwise.
+	 */
+	template<typename Point>
+	bool loadPointClouds(
+		std::vector<typename pcl::PointCloud<Point>::Ptr> & clouds,
+		PointCloudOptions const & options = PointCloudOptions(),
+		bool registered = false,
+		bool capture = true
+	) {
+		if (capture && !this->capture()) return false;
+
+		clouds.resize(cameras.size());
+		forEach([this, &clouds, &options, registered] (Ensenso & camera, std::size_t index) {
+			if (!clouds[index]) clouds[index].reset(new pcl::PointCloud<Point>);
+			if (registered) {
+				camera.computeDisparityMap();
+
+				// the rendered point map is a single global NxLib node, so another camera must not render over it before it is converted
+				std::lock_guard<std::mutex> lock(render_mutex);
+				camera.renderPointMap();
+				camera.convertPointCloud(*clouds[index], true, options);
+			} else {
+				camera.loadPointCloud(*clouds[index], options, cv::Rect(), false);
+			}
+		});
+		return true;
+	}
+};
+
+}
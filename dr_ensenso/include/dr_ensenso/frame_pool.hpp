@@ -0,0 +1,160 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <sensor_msgs/PointCloud2.h>
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace dr {
+
+/// Pool of preallocated images that are recycled once they are no longer used outside the pool.
+/**
+ * An image is considered free again when the pool holds the only reference to its data.
+ * Images handed out by the pool can be passed to Ensenso::loadIntensity to load new data without allocating.
+ */
+class ImagePool {
+	/// Mutex protecting the pool.
+	std::mutex mutex;
+
+	/// The images owned by the pool.
+	std::vector<cv::Mat> images;
+
+	/// The maximum number of images owned by the pool.
+	std::size_t capacity;
+
+	/// The size of new images.
+	cv::Size size;
+
+	/// The OpenCV type of new images.
+	int type = CV_8UC1;
+
+public:
+	/// Construct a pool holding at most capacity images.
+	explicit ImagePool(std::size_t capacity = 2);
+
+	/// Allocate all images in the pool with the given size and type.
+	/**
+	 * Images that are currently in use are reallocated when they are recycled.
+	 */
+	void reserve(cv::Size size, int type);
+
+	/// Get an image that is not in use.
+	/**
+	 * If all images are in use and the pool is full, a new image is returned that is not owned by the pool.
+	 */
+	cv::Mat get();
+};
+
+/// Pool of preallocated point clouds that are recycled once they are no longer used outside the pool.
+/**
+ * A point cloud is considered free again when the pool holds the only reference to it.
+ * Point clouds handed out by the pool can be passed to Ensenso::loadPointCloud to load new data without allocating.
+ */
+template<typename Point>
+class PointCloudPool {
+public:
+	using PointCloud = pcl::PointCloud<Point>;
+
+private:
+	/// Mutex protecting the pool.
+	std::mutex mutex;
+
+	/// The point clouds owned by the pool.
+	std::vector<typename PointCloud::Ptr> clouds;
+
+	/// The maximum number of point clouds owned by the pool.
+	std::size_t capacity;
+
+	/// The number of points to reserve for new point clouds.
+	std::size_t points = 0;
+
+public:
+	/// Construct a pool holding at most capacity point clouds.
+	explicit PointCloudPool(std::size_t capacity = 2) : capacity(capacity) {}
+
+	/// Reserve room in all point clouds in the pool for a point map of the given size.
+	void reserve(cv::Size size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		points = size.area();
+		while (clouds.size() < capacity) clouds.push_back(typename PointCloud::Ptr(new PointCloud));
+		for (typename PointCloud::Ptr const & cloud : clouds) {
+			if (cloud.use_count() == 1) cloud->points.reserve(points);
+		}
+	}
+
+	/// Get a point cloud that is not in use.
+	/**
+	 * If all point clouds are in use and the pool is full, a new point cloud is returned that is not owned by the pool.
+	 */
+	typename PointCloud::Ptr get() {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (typename PointCloud::Ptr const & cloud : clouds) {
+			if (cloud.use_count() == 1) {
+				if (cloud->points.capacity() < points) cloud->points.reserve(points);
+				return cloud;
+			}
+		}
+
+		typename PointCloud::Ptr cloud(new PointCloud);
+		cloud->points.reserve(points);
+		if (clouds.size() < capacity) clouds.push_back(cloud);
+		return cloud;
+	}
+};
+
+/// Pool of point cloud messages that are recycled once they are no longer used outside the pool.
+/**
+ * A message is considered free again when the pool holds the only reference to it,
+ * so messages that were published or queued elsewhere are never modified while they are shared.
+ * Recycled messages keep the capacity of their data buffer, so converting a point map of the same size into them does not allocate.
+ */
+class PointCloud2Pool {
+	/// Mutex protecting the pool.
+	std::mutex mutex;
+
+	/// The messages owned by the pool.
+	std::vector<sensor_msgs::PointCloud2Ptr> clouds;
+
+	/// The maximum number of messages owned by the pool.
+	std::size_t capacity;
+
+public:
+	/// Construct a pool holding at most capacity messages.
+	explicit PointCloud2Pool(std::size_t capacity = 2);
+
+	/// Get a message that is not in use.
+	/**
+	 * If all messages are in use and the pool is full, a new message is returned that is not owned by the pool.
+	 */
+	sensor_msgs::PointCloud2Ptr get();
+};
+
+/// Pool of point clouds and intensity images for a single camera.
+template<typename Point>
+struct FramePool {
+	/// The point clouds.
+	PointCloudPool<Point> clouds;
+
+	/// The intensity images.
+	ImagePool images;
+
+	/// Construct a frame pool holding at most capacity point clouds and images.
+	explicit FramePool(std::size_t capacity = 2) : clouds(capacity), images(capacity) {}
+
+	/// Preallocate all point clouds and images in the pool.
+	/**
+	 * \param cloud_size The size of the point clouds, as returned by Ensenso::getPointCloudSize.
+	 * \param image_size The size of the images, as returned by Ensenso::getIntensitySize.
+	 * \param image_type The OpenCV type of the images, as returned by Ensenso::getIntensityType.
+	 */
+	void reserve(cv::Size cloud_size, cv::Size image_size, int image_type) {
+		clouds.reserve(cloud_size);
+		images.reserve(image_size, image_type);
+	}
+};
+
+}
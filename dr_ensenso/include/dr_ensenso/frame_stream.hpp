@@ -0,0 +1,257 @@
+#pragma once
+
+#include "ensenso.hpp"
+#include "frame_pool.hpp"
+#include "pcl.hpp"
+#include "ring_buffer.hpp"
+
+#include <opencv2/core/core.hpp>
+#include <pcl/point_cloud.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace dr {
+
+/// Options for streaming frames from a camera.
+struct StreamOptions {
+	/// The options for converting the point maps to point clouds.
+	PointCloudOptions cloud;
+
+	/// The region of interest for the point clouds.
+	cv::Rect roi;
+
+	/// If true, stream point clouds registered to the monocular camera.
+	bool registered = false;
+
+	/// If true, load the intensity image with every frame.
+	bool intensity = true;
+
+	/// The timeout in milliseconds for retrieving the images of a frame.
+	unsigned int timeout = 1500;
+
+	/// The number of finished frames buffered for the consumer.
+	/**
+	 * When the buffer is full, new frames are dropped until the consumer takes a frame.
+	 */
+	std::size_t capacity = 3;
+
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/// A frame produced by a FrameStream.
+template<typename Point>
+struct StreamFrame {
+	/// The number of the frame, counting all captured frames since the stream started.
+	std::uint64_t sequence = 0;
+
+	/// The point cloud.
+	typename pcl::PointCloud<Point>::Ptr cloud;
+
+	/// The intensity image, or an empty image if the stream does not load intensity images.
+	cv::Mat intensity;
+};
+
+/// Continuously captures frames from a camera on a background thread.
+/**
+ * The stream thread triggers the next capture before loading the point cloud of the current frame,
+ * so the exposure and transfer of the next frame overlap with computing the current one.
+ * Finished frames are passed to the consumer through a lock-free ring buffer,
+ * with their point clouds and images recycled through a FramePool.
+ *
+ * The camera must not be used by other threads while the stream is running.
+ * A single thread may take frames from the stream.
+ */
+template<typename Point>
+class FrameStream {
+public:
+	/// Start streaming from a camera.
+	/**
+	 * The camera must outlive the stream.
+	 */
+	explicit FrameStream(Ensenso & ensenso, StreamOptions const & options = StreamOptions()) :
+		ensenso(ensenso),
+		options(options),
+		frames(options.capacity),
+		pool(options.capacity + 3)
+	{
+		if (!options.registered) pool.clouds.reserve(ensenso.getPointCloudSize());
+		if (options.intensity) pool.images.reserve(ensenso.getIntensitySize(), ensenso.getIntensityType());
+
+		// The stream takes over the camera, so an earlier cancellation must not stop it.
+		ensenso.resumeRetrieve();
+		thread = std::thread(&FrameStream::run, this);
+	}
+
+	/// Stop streaming.
+	~FrameStream() {
+		stop();
+	}
+
+	FrameStream(FrameStream const &) = delete;
+	FrameStream & operator=(FrameStream const &) = delete;
+
+	/// Stop the stream thread after it finishes the current frame. Frames already buffered can still be taken.
+	/**
+	 * If the stream thread is waiting for a frame, the wait is cancelled.
+	 * The cancellation stays in effect until the thread finished, so it can not be missed by a retrieve that is just starting.
+	 */
+	void stop() {
+		stopping = true;
+		ensenso.cancelRetrieve();
+		if (thread.joinable()) thread.join();
+		ensenso.resumeRetrieve();
+	}
+
+	/// Take the oldest buffered frame, waiting for a new frame if none is buffered.
+	/**
+	 * The previous contents of frame are released, so its point cloud and image can be recycled by the stream.
+	 *
+	 * \return False if no frame became available within the timeout.
+	 * \throw The exception that stopped the stream thread, once all buffered frames are taken.
+	 */
+	bool next(StreamFrame<Point> & frame, std::chrono::milliseconds timeout = std::chrono::milliseconds(3000)) {
+		if (frames.pop(frame)) return true;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait_for(lock, timeout, [this] () { return !frames.empty() || finished; });
+		}
+		if (frames.pop(frame)) return true;
+		rethrowError();
+		return false;
+	}
+
+	/// Take the newest buffered frame without waiting, discarding all older buffered frames.
+	/**
+	 * \return False if no frame is buffered.
+	 * \throw The exception that stopped the stream thread, once all buffered frames are taken.
+	 */
+	bool latest(StreamFrame<Point> & frame) {
+		std::size_t taken = frames.popLatest(frame);
+		if (taken) {
+			skipped += taken - 1;
+			return true;
+		}
+		rethrowError();
+		return false;
+	}
+
+	/// The number of frames dropped by the stream thread because the buffer was full.
+	std::uint64_t dropped() const {
+		return dropped_frames;
+	}
+
+	/// The number of buffered frames discarded by latest().
+	std::uint64_t discarded() const {
+		return skipped;
+	}
+
+	/// Check if the stream thread is still running.
+	bool running() const {
+		return !finished;
+	}
+
+private:
+	/// Main loop of the stream thread.
+	void run() {
+		try {
+			std::uint64_t sequence = 0;
+			bool triggered = ensenso.trigger();
+
+			while (!stopping) {
+				// A retrieve that times out or is cancelled leaves its capture pending, and the next trigger collects and discards it first,
+				// so only a capture that was retrieved or discarded is followed by a new capture.
+				bool retrieved = triggered && ensenso.retrieveUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(options.timeout), false);
+				if (stopping) {
+					triggered = false;
+					break;
+				}
+
+				// Let the camera expose and transfer the next frame while this one is processed.
+				// The raw images are only overwritten when the next frame is retrieved.
+				triggered = ensenso.trigger();
+				if (!retrieved) continue;
+
+				StreamFrame<Point> frame;
+				frame.sequence = sequence++;
+				frame.cloud    = pool.clouds.get();
+				if (options.registered) {
+					ensenso.loadRegisteredPointCloud(*frame.cloud, options.cloud, options.roi, false);
+				} else {
+					ensenso.loadPointCloud(*frame.cloud, options.cloud, options.roi, false);
+				}
+				if (options.intensity) {
+					frame.intensity = pool.images.get();
+					ensenso.loadIntensity(frame.intensity, false);
+				}
+
+				if (!frames.push(std::move(frame))) {
+					++dropped_frames;
+					continue;
+				}
+				std::lock_guard<std::mutex> lock(mutex);
+				condition.notify_one();
+			}
+
+			// Collect the last triggered frame so the camera is idle when the stream stops.
+			if (triggered) ensenso.retrieve(false, options.timeout);
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		finished = true;
+		condition.notify_one();
+	}
+
+	/// Rethrow the exception that stopped the stream thread, if any.
+	void rethrowError() {
+		if (finished && error) std::rethrow_exception(error);
+	}
+
+	/// The camera to stream from.
+	Ensenso & ensenso;
+
+	/// The stream options.
+	StreamOptions options;
+
+	/// Finished frames waiting for the consumer.
+	SpscRingBuffer<StreamFrame<Point>> frames;
+
+	/// Pool of point clouds and images for new frames.
+	FramePool<Point> pool;
+
+	/// Mutex for waiting on new frames. The frames themselves are passed without locking.
+	std::mutex mutex;
+
+	/// Condition signalled when a frame is buffered or the stream thread finishes.
+	std::condition_variable condition;
+
+	/// If true, the stream thread stops after the current frame.
+	std::atomic<bool> stopping{false};
+
+	/// Set when the stream thread has finished.
+	std::atomic<bool> finished{false};
+
+	/// Frames dropped because the buffer was full.
+	std::atomic<std::uint64_t> dropped_frames{0};
+
+	/// Buffered frames discarded by latest().
+	std::uint64_t skipped = 0;
+
+	/// The exception that stopped the stream thread. Only read after finished is set.
+	std::exception_ptr error;
+
+	/// The stream thread.
+	std::thread thread;
+
+public:
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+}
@@ -11,6 +11,14 @@ namespace dr {
  */
 cv::Mat toCvMat(NxLibItem const & item, std::string const & what = "");
 
+/// Convert an NxLibItem to a cv::Mat, reusing the buffer of an existing cv::Mat.
+/**
+ * Like cv::Mat::create, the data of result is only reallocated if it does not have the right size and type.
+ * Otherwise the data is overwritten in place, which also affects any other cv::Mat sharing the same data.
+ * \throw NxError on failure.
+ */
+void toCvMat(cv::Mat & result, NxLibItem const & item, std::string const & what = "");
+
 /// Convert a stereo NxLibItem containing camera matrix to a cv::Mat.
 /**
  * The camera matrix corresponds to the K parameter in OpenCV.
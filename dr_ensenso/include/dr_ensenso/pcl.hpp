@@ -1,16 +1,211 @@
 #pragma once
+#include <Eigen/Geometry>
+#include <boost/optional.hpp>
+#include <opencv2/core/core.hpp>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
+#include <sensor_msgs/PointCloud2.h>
 #include <ensenso/nxLib.h>
 
+#include <cstdint>
+#include <limits>
 #include <string>
+#include <vector>
 
 namespace dr {
 
-/// Convert an NxLibItem to a cv::Mat.
+class ThreadPool;
+
+/// Statistics of a point map conversion.
+struct PointCloudStatistics {
+	/// The number of pixels of the point map that were sampled, after decimation.
+	std::size_t sampled = 0;
+
+	/// The number of sampled pixels with a valid point inside the crop box.
+	std::size_t valid = 0;
+
+	/// The number of points in the resulting point cloud.
+	std::size_t points = 0;
+
+	/// The bounding box in point map pixels of the sampled pixels with a valid point, or an empty rectangle if there are none.
+	/**
+	 * The crop box is only taken into account for organized point clouds that are converted in place,
+	 * otherwise the region may include pixels with points outside the crop box.
+	 */
+	cv::Rect region;
+};
+
+/// Box to crop point clouds to.
+struct CropBox {
+	/// Minimum corner of the box in its own frame, in meters.
+	Eigen::Vector3d min;
+
+	/// Maximum corner of the box in its own frame, in meters.
+	Eigen::Vector3d max;
+
+	/// Pose of the box in the frame of the (transformed) point cloud. The identity gives an axis aligned box.
+	Eigen::Isometry3d pose;
+
+	CropBox(Eigen::Vector3d const & min, Eigen::Vector3d const & max, Eigen::Isometry3d const & pose = Eigen::Isometry3d::Identity()) :
+		min(min), max(max), pose(pose) {}
+
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/// Options for converting a point map to a point cloud.
+struct PointCloudOptions {
+	/// If true, remove invalid points and produce an unorganized point cloud with is_dense set.
+	/**
+	 * Valid points are compacted in parallel chunks of rows.
+	 * The packed point map is retrieved into a per-thread staging buffer which is reused between calls.
+	 */
+	bool dense = false;
+
+	/// Only convert every n-th pixel of every n-th row of the point map.
+	/**
+	 * The pixel in the top left corner of each n by n block is kept.
+	 * Organized point clouds keep their organization with a correspondingly smaller width and height.
+	 * Must be at least 1, which converts the full point map.
+	 */
+	int decimation = 1;
+
+	/// If positive, reduce the point cloud to the centroid of the valid points in each voxel of this size in meters.
+	/**
+	 * This matches the result of pcl::VoxelGrid, including the averaged intensity or color,
+	 * but is applied during conversion so the full resolution cloud is never created.
+	 * The result is always an unorganized dense point cloud, ordered by voxel.
+	 * Decimation is applied before voxel filtering.
+	 */
+	double voxel_size = 0;
+
+	/// The thread pool to split the conversion over in blocks of rows, or null to use defaultThreadPool().
+	/**
+	 * With a single thread, organized point clouds are converted in place in the storage of the point cloud.
+	 * With more threads, the point map is retrieved into the staging buffer so the row blocks can be converted independently.
+	 */
+	ThreadPool * thread_pool = nullptr;
+
+	/// If not null, receives the statistics of the conversion.
+	PointCloudStatistics * statistics = nullptr;
+
+	/// If set, transform the points with this transformation after converting them to meters.
+	/**
+	 * For example the workspace calibration from Ensenso::getWorkspaceCalibration(),
+	 * to get the points in the calibrated frame without a separate pass over the point cloud.
+	 */
+	boost::optional<Eigen::Isometry3d> transform;
+
+	/// If set, only keep the points inside this box, which is applied after the transformation.
+	/**
+	 * Points outside the box are treated like invalid points:
+	 * they are set to NaN in organized point clouds and left out of dense and voxel filtered point clouds.
+	 */
+	boost::optional<CropBox> crop_box;
+
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/// Convert an NxLibItem holding a point map to a point cloud.
+/**
+ * The binary data is retrieved directly into the storage of the point cloud and converted in place,
+ * so the capacity of the point cloud is reused if it is large enough.
+ *
+ * \throw NxError on failure.
+ */
+void toPointCloud(pcl::PointCloud<pcl::PointXYZ> & cloud, NxLibItem const & item, std::string const & what = "");
+
+/// Convert an NxLibItem holding a point map to a point cloud.
 /**
  * \throw NxError on failure.
  */
 pcl::PointCloud<pcl::PointXYZ> toPointCloud(NxLibItem const & item, std::string const & what = "");
 
+/// Convert an NxLibItem holding a point map to a point cloud, taking intensity or color information from a texture.
+/**
+ * The texture is sampled in the same pass that converts the point map.
+ * It must have the same size as the point map and be an 8 bit grayscale or BGR image, as returned by toCvMat.
+ * An empty texture leaves the intensity or color of the points at their default value.
+ *
+ * Supported point types are pcl::PointXYZ, pcl::PointXYZI and pcl::PointXYZRGB.
+ * For pcl::PointXYZI the intensity is taken from the grayscale value of the texture.
+ * For pcl::PointXYZRGB grayscale textures are copied to all color channels.
+ * For pcl::PointXYZ the texture is ignored.
+ *
+ * \throw NxError on failure.
+ */
+template<typename Point>
+void toPointCloud(pcl::PointCloud<Point> & cloud, NxLibItem const & item, cv::Mat const & texture, std::string const & what = "");
+
+/// Convert an NxLibItem holding a point map to a point cloud with the given options.
+/**
+ * The texture is handled as by the other overloads and may be empty.
+ *
+ * \param indices If not null, receives the index in the point map of each point in a dense or decimated point cloud.
+ *                For voxel filtered point clouds it receives the lowest index of the pixels in each voxel.
+ *                For full resolution organized point clouds the indices are cleared, since point i comes from pixel i.
+ *
+ * \throw NxError on failure.
+ */
+template<typename Point>
+void toPointCloud(
+	pcl::PointCloud<Point> & cloud,
+	NxLibItem const & item,
+	cv::Mat const & texture,
+	PointCloudOptions const & options,
+	std::vector<int> * indices = nullptr,
+	std::string const & what = ""
+);
+
+/// Convert an NxLibItem holding a point map directly to a PointCloud2 message.
+/**
+ * The points are written straight into the data buffer of the message,
+ * with the same fields and memory layout that pcl::toROSMsg would produce for the given PCL point type.
+ * This avoids converting to an intermediate pcl::PointCloud.
+ *
+ * The texture, options and indices are handled as by toPointCloud.
+ *
+ * \throw NxError on failure.
+ */
+template<typename Point>
+void toPointCloud2(
+	sensor_msgs::PointCloud2 & cloud,
+	NxLibItem const & item,
+	cv::Mat const & texture,
+	PointCloudOptions const & options = PointCloudOptions(),
+	std::vector<int> * indices = nullptr,
+	std::string const & what = ""
+);
+
+/// Convert an NxLibItem holding a point map to a compact PointCloud2 message with millimeter precision.
+/**
+ * The message has INT16 fields x, y and z holding the coordinates in millimeters, for 6 bytes per point.
+ * That is less than half the size of a pcl::PointXYZ message, at the native precision of the camera.
+ * Invalid points and points beyond the range of a 16 bit integer (about 32 meters) have all coordinates set to compactInvalid.
+ *
+ * The options and indices are handled as by toPointCloud.
+ *
+ * \throw NxError on failure.
+ */
+void toCompactPointCloud2(
+	sensor_msgs::PointCloud2 & cloud,
+	NxLibItem const & item,
+	PointCloudOptions const & options = PointCloudOptions(),
+	std::vector<int> * indices = nullptr,
+	std::string const & what = ""
+);
+
+/// Coordinate value marking invalid points in compact point clouds.
+constexpr std::int16_t compactInvalid = std::numeric_limits<std::int16_t>::min();
+
+/// Check if a PointCloud2 message uses the compact encoding produced by toCompactPointCloud2, with rows of at least width points.
+bool isCompactPointCloud2(sensor_msgs::PointCloud2 const & cloud);
+
+/// Decode a compact PointCloud2 message into a point cloud in meters.
+/**
+ * Invalid points are decoded as NaN. The header and organization of the message are preserved.
+ *
+ * \throw std::runtime_error if the message does not use the compact encoding, or holds less data than its size and row step indicate.
+ */
+void fromCompactPointCloud2(pcl::PointCloud<pcl::PointXYZ> & cloud, sensor_msgs::PointCloud2 const & message);
+
 }
@@ -0,0 +1,111 @@
+#pragma once
+#include <pcl/point_types.h>
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+namespace dr {
+
+/// Convert packed XYZ floats to PCL points, dividing all coordinates by a constant.
+/**
+ * The padding of the points is set to 1, as done by the constructor of pcl::PointXYZ.
+ * NaN coordinates are passed through unchanged.
+ *
+ * The coordinates are divided rather than multiplied by the reciprocal,
+ * so that converting millimeters to meters gives exactly the same result as a plain division.
+ *
+ * The fastest implementation supported by the CPU (SSE2 or plain scalar code) is selected at runtime.
+ *
+ * Points are processed back to front, so the input may live at the start of the storage of the output.
+ * This allows the conversion to be done in place.
+ *
+ * \return The number of valid points, which are points with a z coordinate that is not NaN.
+ */
+std::size_t convertPointMap(float const * input, pcl::PointXYZ * output, std::size_t count, float divisor);
+
+/// Geometric part of converting packed XYZ floats to points: scaling, an optional affine transformation and an optional crop box.
+struct PointMapTransform {
+	/// The divisor to scale the input coordinates with, applied before anything else.
+	float divisor = 1000.0f;
+
+	/// If true, apply the affine transformation in matrix after scaling.
+	bool transformed = false;
+
+	/// Row major 3x4 affine transformation matrix.
+	float matrix[12] = {};
+
+	/// If true, reject points outside the crop box.
+	bool cropped = false;
+
+	/// Row major 3x4 affine transformation matrix from the (transformed) output frame to the frame of the crop box.
+	float crop_matrix[12] = {};
+
+	/// Minimum corner of the crop box in its own frame.
+	float crop_min[3] = {};
+
+	/// Maximum corner of the crop box in its own frame.
+	float crop_max[3] = {};
+
+	/// Check if the transformation only scales the coordinates.
+	bool scaleOnly() const {
+		return !transformed && !cropped;
+	}
+
+	/// Apply the transformation to a single point.
+	/**
+	 * The input may not overlap the output.
+	 * \return True if the input point is valid and inside the crop box. Otherwise the output is set to NaN.
+	 */
+	bool apply(float const * input, float * output) const {
+		float x = input[0] / divisor;
+		float y = input[1] / divisor;
+		float z = input[2] / divisor;
+
+		if (std::isnan(z)) return reject(output);
+
+		if (transformed) {
+			output[0] = matrix[0] * x + matrix[1] * y + matrix[2]  * z + matrix[3];
+			output[1] = matrix[4] * x + matrix[5] * y + matrix[6]  * z + matrix[7];
+			output[2] = matrix[8] * x + matrix[9] * y + matrix[10] * z + matrix[11];
+		} else {
+			output[0] = x;
+			output[1] = y;
+			output[2] = z;
+		}
+
+		if (cropped) {
+			// Avoid short-circuiting, since branches on scattered points are hard to predict.
+			bool inside = true;
+			for (int axis = 0; axis < 3; ++axis) {
+				float const * row = crop_matrix + axis * 4;
+				float value = row[0] * output[0] + row[1] * output[1] + row[2] * output[2] + row[3];
+				inside &= (value >= crop_min[axis]) & (value <= crop_max[axis]);
+			}
+			if (!inside) return reject(output);
+		}
+
+		return true;
+	}
+
+private:
+	/// Mark a point as invalid.
+	static bool reject(float * output) {
+		output[0] = output[1] = output[2] = std::numeric_limits<float>::quiet_NaN();
+		return false;
+	}
+};
+
+/// Convert packed XYZ floats to PCL points, applying a transformation.
+/**
+ * Invalid points and points outside the crop box get NaN coordinates.
+ * The padding of the points is set to 1, as done by the constructor of pcl::PointXYZ.
+ *
+ * The fastest implementation supported by the CPU (SSE2 or plain scalar code) is selected at runtime.
+ * Like the other overload, points are processed back to front so the conversion can be done in place.
+ *
+ * \return The number of valid points inside the crop box.
+ */
+std::size_t convertPointMap(float const * input, pcl::PointXYZ * output, std::size_t count, PointMapTransform const & transform);
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace dr {
+
+/// Lock-free ring buffer for a single producer thread and a single consumer thread.
+/**
+ * Values are moved into and out of preallocated slots, so no memory is allocated after construction.
+ * Slots between the read and write position belong to the consumer, all other slots to the producer.
+ */
+template<typename T>
+class SpscRingBuffer {
+	/// The slots, one more than the capacity to distinguish a full buffer from an empty one.
+	std::vector<T> slots;
+
+	/// The slot the producer writes next.
+	std::atomic<std::size_t> head;
+
+	/// The slot the consumer reads next.
+	std::atomic<std::size_t> tail;
+
+	/// Get the slot after the given slot.
+	std::size_t next(std::size_t slot) const {
+		return slot + 1 == slots.size() ? 0 : slot + 1;
+	}
+
+public:
+	/// Construct a ring buffer holding at most capacity values.
+	explicit SpscRingBuffer(std::size_t capacity) : slots(capacity + 1), head(0), tail(0) {}
+
+	SpscRingBuffer(SpscRingBuffer const &) = delete;
+	SpscRingBuffer & operator=(SpscRingBuffer const &) = delete;
+
+	/// Get the maximum number of values in the buffer.
+	std::size_t capacity() const {
+		return slots.size() - 1;
+	}
+
+	/// Check if the buffer is empty. Only exact when called by the consumer.
+	bool empty() const {
+		return tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire);
+	}
+
+	/// Move a value into the buffer. May only be called by the producer.
+	/**
+	 * \return False if the buffer is full, in which case the value is left untouched.
+	 */
+	bool push(T && value) {
+		std::size_t write = head.load(std::memory_order_relaxed);
+		if (next(write) == tail.load(std::memory_order_acquire)) return false;
+		slots[write] = std::move(value);
+		head.store(next(write), std::memory_order_release);
+		return true;
+	}
+
+	/// Move the oldest value out of the buffer. May only be called by the consumer.
+	/**
+	 * \return False if the buffer is empty.
+	 */
+	bool pop(T & value) {
+		std::size_t read = tail.load(std::memory_order_relaxed);
+		if (read == head.load(std::memory_order_acquire)) return false;
+		value = std::move(slots[read]);
+		slots[read] = T();
+		tail.store(next(read), std::memory_order_release);
+		return true;
+	}
+
+	/// Move the newest value out of the buffer and discard all older values. May only be called by the consumer.
+	/**
+	 * \return The number of values taken from the buffer, including the discarded ones. Zero if the buffer is empty.
+	 */
+	std::size_t popLatest(T & value) {
+		std::size_t read  = tail.load(std::memory_order_relaxed);
+		std::size_t write = head.load(std::memory_order_acquire);
+		if (read == write) return 0;
+
+		std::size_t taken = 0;
+		for (; next(read) != write; read = next(read), ++taken) slots[read] = T();
+		value = std::move(slots[read]);
+		slots[read] = T();
+		tail.store(write, std::memory_order_release);
+		return taken + 1;
+	}
+};
+
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dr {
+
+/// Pool of persistent worker threads that run chunks of work in parallel.
+/**
+ * The threads are started once and wait for work in between calls to parallelFor,
+ * so splitting a conversion in chunks does not pay for starting threads on every frame.
+ */
+class ThreadPool {
+public:
+	/// Create a thread pool.
+	/**
+	 * \param threads The number of threads that run chunks, including the thread calling parallelFor.
+	 *                Zero means one thread per hardware thread.
+	 */
+	explicit ThreadPool(std::size_t threads = 0);
+
+	/// Stop and join all worker threads.
+	~ThreadPool();
+
+	ThreadPool(ThreadPool const &) = delete;
+	ThreadPool & operator=(ThreadPool const &) = delete;
+
+	/// Get the number of threads that run chunks, including the thread calling parallelFor.
+	std::size_t size() const {
+		return workers.size() + 1;
+	}
+
+	/// Run function(chunk) for every chunk in [0, count) and wait for all of them to finish.
+	/**
+	 * The calling thread runs chunks too. Concurrent calls from different threads are run one after the other.
+	 * The function must not call parallelFor on the same pool.
+	 * If a chunk throws, the remaining chunks still run and the first exception is rethrown.
+	 */
+	void parallelFor(std::size_t count, std::function<void (std::size_t)> const & function);
+
+private:
+	/// Main loop of the worker threads.
+	void work();
+
+	/// Run chunks of the current job until there are none left.
+	void runChunks(std::function<void (std::size_t)> const & function, std::size_t count);
+
+	/// The worker threads.
+	std::vector<std::thread> workers;
+
+	/// Serializes calls to parallelFor.
+	std::mutex dispatch_mutex;
+
+	/// Protects the job state below.
+	std::mutex mutex;
+
+	/// Signals the workers that a job is available or the pool is stopping.
+	std::condition_variable start_condition;
+
+	/// Signals parallelFor that the job is done.
+	std::condition_variable done_condition;
+
+	/// The function of the current job, or null.
+	std::function<void (std::size_t)> const * job = nullptr;
+
+	/// The number of chunks of the current job.
+	std::size_t job_count = 0;
+
+	/// The next chunk of the current job to run.
+	std::size_t next_chunk = 0;
+
+	/// The number of workers working on the current job.
+	std::size_t active = 0;
+
+	/// Incremented for every job, so workers can tell a new job from a spurious wake up.
+	std::uint64_t generation = 0;
+
+	/// The first exception thrown by a chunk of the current job.
+	std::exception_ptr error;
+
+	/// If true, the workers stop.
+	bool stop = false;
+};
+
+/// Get a thread pool shared by all conversions that do not specify their own pool.
+/**
+ * The pool uses one thread per hardware thread and is created on first use.
+ */
+ThreadPool & defaultThreadPool();
+
+}
@@ -5,6 +5,7 @@
 
 #include <boost/optional.hpp>
 
+#include <functional>
 #include <string>
 #include <stdexcept>
 #include <cstdint>
@@ -12,6 +13,15 @@
 
 namespace dr {
 
+/// Initialize the NxLib unless it is already initialized.
+/**
+ * Initialization is reference counted, every call must be matched by a call to finalizeNxLib().
+ */
+void initializeNxLib();
+
+/// Finalize the NxLib when the last user that initialized it is done.
+void finalizeNxLib();
+
 /// Find a camera by serial number.
 boost::optional<NxLibItem> findCameraBySerial(std::string const & serial);
 
@@ -58,12 +68,46 @@ boost::optional<NxLibItem> openCameraByLink(std::string const & serial);
  */
 boost::optional<NxLibItem> openCameraByType(std::string const & type);
 
+/// Get the number of NxLib tree accesses made by this library since the program started.
+/**
+ * Every read, write, existence check and command execution counts as one access.
+ * Take the difference between two calls to measure the accesses made for a single frame.
+ */
+std::uint64_t nxTreeAccesses();
+
+/// Record NxLib tree accesses for nxTreeAccesses().
+void countNxTreeAccess(std::uint64_t count = 1);
+
 /// Execute an NxLibCommand.
 /**
  * \throw NxError on failure.
  */
 void executeNx(NxLibCommand const & command, std::string const & what = "");
 
+/// An NxLibCommand in a slot of its own, so its parameters stay in the tree between executions.
+struct PreparedNxCommand {
+	/// The command.
+	NxLibCommand command;
+
+	/// Key identifying the parameters currently written to the tree.
+	std::uint64_t key = 0;
+
+	/// If false, no parameters have been written yet.
+	bool prepared = false;
+
+	/// Create a command in the slot with the given name.
+	PreparedNxCommand(std::string const & name, std::string const & slot) : command(name, slot) {}
+
+	/// Write the parameters identified by key, unless they are already in the tree.
+	/**
+	 * If other parameters were written before, they are erased first.
+	 * Commands do not modify their own parameters, so parameters only need to be rewritten when the key changes.
+	 *
+	 * \throw NxError on failure.
+	 */
+	void prepare(std::uint64_t key, std::function<void (NxLibItem const & parameters)> const & write);
+};
+
 /// Get the value of an NxLibItem as the specified type.
 /**
  * \throw NxError on failure.
@@ -71,6 +115,7 @@ void executeNx(NxLibCommand const & command, std::string const & what = "");
 template<typename T>
 T getNx(NxLibItem const & item, std::string const & what = "") {
 	int error = 0;
+	countNxTreeAccess();
 	T result = item.as<T>(&error);
 	if (error) throw NxError(item, error, what);
 	return result;
@@ -86,6 +131,7 @@ std::int64_t getNxBinaryTimestamp(NxLibItem const & item, std::string const & wh
 template<typename T>
 void setNx(NxLibItem const & item, T const & value, std::string const & what = "") {
 	int error = 0;
+	countNxTreeAccess();
 	item.set(&error, value);
 	if (error) throw NxError(item, error, what);
 }
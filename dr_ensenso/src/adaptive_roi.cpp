@@ -0,0 +1,50 @@
+#include "adaptive_roi.hpp"
+
+#include <algorithm>
+
+namespace dr {
+
+AdaptiveRoi::AdaptiveRoi(cv::Size image_size, AdaptiveRoiOptions const & options) :
+	options(options),
+	image_size(image_size),
+	bounds(cv::Point(0, 0), image_size) {}
+
+void AdaptiveRoi::setBounds(cv::Rect const & bounds) {
+	cv::Rect full(cv::Point(0, 0), image_size);
+	this->bounds = bounds.area() ? bounds & full : full;
+	reset();
+}
+
+cv::Rect AdaptiveRoi::next() {
+	if (regions.empty() || (options.refresh_interval && frames >= options.refresh_interval)) {
+		frames = 0;
+		return bounds;
+	}
+
+	++frames;
+	cv::Rect roi = regions.front();
+	for (cv::Rect const & region : regions) roi |= region;
+	roi -= cv::Point(options.margin, options.margin);
+	roi += cv::Size(2 * options.margin, 2 * options.margin);
+	roi &= bounds;
+
+	// Fall back to the full bounds rather than computing nothing.
+	return roi.area() ? roi : bounds;
+}
+
+void AdaptiveRoi::update(cv::Rect const & valid_region) {
+	if (valid_region.area() == 0) {
+		reset();
+		return;
+	}
+
+	regions.push_back(valid_region);
+	while (regions.size() > std::max<std::size_t>(options.history, 1)) regions.pop_front();
+}
+
+void AdaptiveRoi::reset() {
+	regions.clear();
+	frames = 0;
+}
+
+}
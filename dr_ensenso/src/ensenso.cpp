@@ -4,14 +4,89 @@
 #include "opencv.hpp"
 #include "pcl.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <sstream>
 #include <stdexcept>
 
 namespace dr {
 
+namespace {
+	/// Check if a point type holds intensity or color information.
+	template<typename Point> bool hasTexture()                 { return true;  }
+	template<>               bool hasTexture<pcl::PointXYZ>() { return false; }
+
+	/// Get the size of an image node, or the binned sensor size of the camera if no image has been captured yet.
+	cv::Size imageSize(NxLibItem const & camera, NxLibItem const & image) {
+		int error = 0;
+		int width, height;
+		countNxTreeAccess();
+		image.getBinaryDataInfo(&error, &width, &height, 0, 0, 0, 0);
+		if (!error) return cv::Size(width, height);
+
+		int binning = 1;
+		countNxTreeAccess();
+		if (camera[itmParameters][itmCapture][itmBinning].exists()) binning = getNx<int>(camera[itmParameters][itmCapture][itmBinning]);
+		return cv::Size(getNx<int>(camera[itmSensor][itmSize][0]) / binning, getNx<int>(camera[itmSensor][itmSize][1]) / binning);
+	}
+
+	/// Records the duration of a pipeline stage when it goes out of scope.
+	class StageTimer {
+		std::chrono::microseconds & duration;
+		std::chrono::steady_clock::time_point start;
+
+	public:
+		explicit StageTimer(std::chrono::microseconds & duration) : duration(duration), start(std::chrono::steady_clock::now()) {}
+
+		~StageTimer() {
+			duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+		}
+	};
+
+	/// Time in milliseconds that trigger() waits for a capture left pending by a retrieve that timed out or was cancelled.
+	unsigned int const pending_capture_timeout = 1000;
+
+	/// Read a whole file into a string.
+	/**
+	 * \return False if the file could not be opened.
+	 */
+	bool readFile(std::string const & filename, std::string & contents) {
+		std::ifstream file(filename);
+		if (!file.good()) return false;
+
+		std::stringstream buffer;
+		buffer << file.rdbuf();
+		contents = buffer.str();
+		return true;
+	}
+
+	/// Check if a setting has to be written to change it from the current value.
+	template<typename T>
+	bool changes(boost::optional<T> const & desired, boost::optional<T> const & current) {
+		return desired && (!current || *current != *desired);
+	}
+
+	/// Add a member to a JSON object under construction.
+	void addJsonMember(std::string & json, std::string const & name, std::string const & value) {
+		json += (json.empty() ? "{\"" : ",\"") + name + "\":" + value;
+	}
+}
+
 Ensenso::Ensenso(std::string serial, bool connect_monocular) {
 	// Initialize nxLib.
-	nxLibInitialize();
+	initializeNxLib();
+	try {
+		open(serial, connect_monocular);
+	} catch (...) {
+		finalizeNxLib();
+		throw;
+	}
+}
 
+void Ensenso::open(std::string const & serial, bool connect_monocular) {
 	if (serial == "") {
 		// Try to find a stereo camera.
 		boost::optional<NxLibItem> camera = openCameraByType(valStereo);
@@ -24,25 +99,87 @@ Ensenso::Ensenso(std::string serial, bool connect_monocular) {
 		ensenso_camera = *camera;
 	}
 
+	this->serial = getNx<std::string>(ensenso_camera[itmSerialNumber]);
+
 	// Get the linked monocular camera.
-	if (connect_monocular) monocular_camera = openCameraByLink(serialNumber());
+	if (connect_monocular) monocular_camera = openCameraByLink(this->serial);
+	if (monocular_camera) monocular_serial = getNx<std::string>(monocular_camera.get()[itmSerialNumber]);
+
+	point_map_item        = ensenso_camera[itmImages][itmPointMap];
+	rectified_left_item   = ensenso_camera[itmImages][itmRectified][itmLeft];
+	render_point_map_item = root[itmImages][itmRenderPointMap];
+
+	// Give the per-frame commands slots of their own, so their parameters only need to be written once.
+	std::string slot = "dr_ensenso_" + this->serial + "_";
+	trigger_command.reset(new PreparedNxCommand(cmdTrigger, slot + cmdTrigger));
+	capture_command.reset(new PreparedNxCommand(cmdCapture, slot + cmdCapture));
+	retrieve_command.reset(new PreparedNxCommand(cmdRetrieve, slot + cmdRetrieve));
+	rectify_command.reset(new PreparedNxCommand(cmdRectifyImages, slot + cmdRectifyImages));
+	disparity_command.reset(new PreparedNxCommand(cmdComputeDisparityMap, slot + cmdComputeDisparityMap));
+	point_map_command.reset(new PreparedNxCommand(cmdComputePointMap, slot + cmdComputePointMap));
+	render_command.reset(new PreparedNxCommand(cmdRenderPointMap, slot + cmdRenderPointMap));
 }
 
 Ensenso::~Ensenso() {
-	executeNx(NxLibCommand(cmdClose));
-	nxLibFinalize();
+	// Finish pending asynchronous operations before closing the camera.
+	{
+		std::lock_guard<std::mutex> lock(async_mutex);
+		async_stop = true;
+	}
+	async_condition.notify_all();
+	if (async_thread.joinable()) async_thread.join();
+
+	// Only close our own cameras, other cameras may still be in use.
+	NxLibCommand command(cmdClose);
+	setNx(command.parameters()[itmCameras][0], serial);
+	if (monocular_camera) setNx(command.parameters()[itmCameras][1], monocular_serial);
+	executeNx(command);
+	finalizeNxLib();
 }
 
-std::string Ensenso::serialNumber() const {
-	return getNx<std::string>(ensenso_camera[itmSerialNumber]);
+bool Ensenso::loadParameters(std::string const parameters_file) {
+	invalidateParameterCache();
+	if (!setNxJsonFromFile(ensenso_camera[itmParameters], parameters_file)) return false;
+	reapplyWorkspaceVolume();
+	return true;
 }
 
-std::string Ensenso::monocularSerialNumber() const {
-	return monocular_camera ? getNx<std::string>(monocular_camera.get()[itmSerialNumber]) : "";
+bool Ensenso::loadCaptureProfile(std::string const & name, std::string const & parameters_file) {
+	std::string profile;
+	if (!readFile(parameters_file, profile)) return false;
+
+	// Validate the profile by applying it, then put back the parameters we had.
+	NxLibItem parameters = ensenso_camera[itmParameters];
+	std::string previous = getNxJson(parameters, "saving parameters to validate capture profile " + name);
+	invalidateParameterCache();
+	try {
+		setNxJson(parameters, profile, "validating capture profile " + name);
+	} catch (NxError const &) {
+		setNxJson(parameters, previous, "restoring parameters after validating capture profile " + name);
+		throw;
+	}
+	setNxJson(parameters, previous, "restoring parameters after validating capture profile " + name);
+
+	capture_profiles[name] = profile;
+	return true;
 }
 
-bool Ensenso::loadParameters(std::string const parameters_file) {
-	return setNxJsonFromFile(ensenso_camera[itmParameters], parameters_file);
+void Ensenso::activateCaptureProfile(std::string const & name) {
+	if (name == active_profile) return;
+
+	std::map<std::string, std::string>::const_iterator profile = capture_profiles.find(name);
+	if (profile == capture_profiles.end()) throw std::runtime_error("No capture profile named " + name + " is loaded.");
+
+	invalidateParameterCache();
+	setNxJson(ensenso_camera[itmParameters], profile->second, "activating capture profile " + name);
+	reapplyWorkspaceVolume();
+	active_profile = name;
+}
+
+std::vector<std::string> Ensenso::captureProfiles() const {
+	std::vector<std::string> result;
+	for (std::pair<std::string const, std::string> const & profile : capture_profiles) result.push_back(profile.first);
+	return result;
 }
 
 bool Ensenso::loadMonocularParameters(std::string const parameters_file) {
@@ -67,27 +204,80 @@ int Ensenso::flexView() const {
 }
 
 void Ensenso::setFlexView(int value) {
+	active_profile.clear();
+	known_settings.flex_view = boost::none;
 	setNx(ensenso_camera[itmParameters][itmCapture][itmFlexView], value);
+	known_settings.flex_view = value;
 }
 
 void Ensenso::setFrontLight(bool state) {
+	active_profile.clear();
+	known_settings.front_light = boost::none;
 	setNx(ensenso_camera[itmParameters][itmCapture][itmFrontLight], state);
+	known_settings.front_light = state;
 }
 
 void Ensenso::setProjector(bool state) {
+	active_profile.clear();
+	known_settings.projector = boost::none;
 	setNx(ensenso_camera[itmParameters][itmCapture][itmProjector], state);
+	known_settings.projector = state;
+}
+
+CaptureSettings Ensenso::captureSettings(CaptureSettings const & settings) {
+	NxLibItem capture = ensenso_camera[itmParameters][itmCapture];
+	if (settings.flex_view   && !known_settings.flex_view)   known_settings.flex_view   = flexView();
+	if (settings.projector   && !known_settings.projector)   known_settings.projector   = getNx<bool>(capture[itmProjector]);
+	if (settings.front_light && !known_settings.front_light) known_settings.front_light = getNx<bool>(capture[itmFrontLight]);
+
+	CaptureSettings result;
+	if (settings.flex_view)   result.flex_view   = known_settings.flex_view;
+	if (settings.projector)   result.projector   = known_settings.projector;
+	if (settings.front_light) result.front_light = known_settings.front_light;
+	return result;
+}
+
+void Ensenso::applyCaptureSettings(CaptureSettings const & settings) {
+	// Collect the changed settings in a JSON object, so they are written in one go.
+	std::string json;
+	if (changes(settings.flex_view, known_settings.flex_view)) {
+		addJsonMember(json, itmFlexView, *settings.flex_view < 0 ? "false" : std::to_string(*settings.flex_view));
+	}
+	if (changes(settings.projector, known_settings.projector)) {
+		addJsonMember(json, itmProjector, *settings.projector ? "true" : "false");
+	}
+	if (changes(settings.front_light, known_settings.front_light)) {
+		addJsonMember(json, itmFrontLight, *settings.front_light ? "true" : "false");
+	}
+	if (json.empty()) return;
+	active_profile.clear();
+
+	// Members of a JSON object are merged into the node, so other capture parameters are left alone.
+	CaptureSettings known = known_settings;
+	known_settings = CaptureSettings();
+	setNxJson(ensenso_camera[itmParameters][itmCapture], json + "}");
+
+	if (settings.flex_view)   known.flex_view   = settings.flex_view;
+	if (settings.projector)   known.projector   = settings.projector;
+	if (settings.front_light) known.front_light = settings.front_light;
+	known_settings = known;
 }
 
 bool Ensenso::trigger(bool stereo, bool monocular) const {
 	monocular = monocular && monocular_camera;
 
-	NxLibCommand command(cmdTrigger);
-	if (stereo) setNx(command.parameters()[itmCameras][0], serialNumber());
-	if (monocular) setNx(command.parameters()[itmCameras][stereo ? 1 : 0], getNx<std::string>(monocular_camera.get()[itmSerialNumber]));
-	executeNx(command);
+	// A capture that an earlier retrieve gave up on would otherwise make the trigger fail or end up in the next retrieve.
+	if (!collectPendingCapture(std::chrono::steady_clock::now() + std::chrono::milliseconds(pending_capture_timeout))) return false;
+
+	trigger_command->prepare(std::uint64_t(stereo) | std::uint64_t(monocular) << 1, [&] (NxLibItem const & parameters) {
+		if (stereo) setNx(parameters[itmCameras][0], serial);
+		if (monocular) setNx(parameters[itmCameras][stereo ? 1 : 0], monocular_serial);
+	});
+	executeNx(trigger_command->command);
 
-	if (stereo && !getNx<bool>(command.result()[serialNumber()][itmTriggered])) return false;
-	if (monocular && !getNx<bool>(command.result()[monocularSerialNumber()][itmTriggered])) return false;
+	NxLibItem result = trigger_command->command.result();
+	if (stereo && !getNx<bool>(result[serial][itmTriggered])) return false;
+	if (monocular && !getNx<bool>(result[monocular_serial][itmTriggered])) return false;
 	return true;
 }
 
@@ -98,111 +288,457 @@ bool Ensenso::retrieve(bool trigger, unsigned int timeout, bool stereo, bool mon
 	if (!stereo && !monocular)
 		return true;
 
-	NxLibCommand command(trigger ? cmdCapture : cmdRetrieve);
-	setNx(command.parameters()[itmTimeout], int(timeout));
-	if (stereo) setNx(command.parameters()[itmCameras][0], serialNumber());
-	if (monocular) setNx(command.parameters()[itmCameras][stereo ? 1 : 0], getNx<std::string>(monocular_camera.get()[itmSerialNumber]));
-	executeNx(command);
+	// Retrieving new data starts a new frame.
+	stage_timings = StageTimings();
+	StageTimer timer(stage_timings.retrieve);
+
+	if (!trigger) {
+		// Waiting without triggering continues a capture that an earlier retrieve gave up on.
+		pending_stereo = pending_monocular = false;
+	} else if (!collectPendingCapture(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout))) {
+		return false;
+	}
+
+	executeRetrieve(trigger ? *capture_command : *retrieve_command, timeout, stereo, monocular);
+	return !stereo && !monocular;
+}
+
+RetrieveResult Ensenso::retrieveUntil(std::chrono::steady_clock::time_point deadline, bool trigger, bool stereo, bool monocular, std::chrono::milliseconds slice) const {
+	monocular = monocular && monocular_camera;
+	RetrieveResult result;
+
+	// nothing to do?
+	if (!stereo && !monocular) return result;
+
+	// A cancellation that arrived before the camera was triggered costs nothing.
+	if (trigger && retrieve_cancelled) {
+		result.status = RetrieveResult::Status::cancelled;
+		return result;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// Retrieving new data starts a new frame.
+	stage_timings = StageTimings();
+	StageTimer timer(stage_timings.retrieve);
+
+	if (!trigger) {
+		// Waiting without triggering continues a capture that an earlier retrieve gave up on.
+		pending_stereo = pending_monocular = false;
+	} else if (!collectPendingCapture(deadline)) {
+		result.status = retrieve_cancelled ? RetrieveResult::Status::cancelled : RetrieveResult::Status::timed_out;
+		result.waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+		return result;
+	}
+
+	if (trigger && !this->trigger(stereo, monocular)) {
+		result.status = RetrieveResult::Status::not_triggered;
+	} else {
+		while (true) {
+			if (retrieve_cancelled) {
+				result.status = RetrieveResult::Status::cancelled;
+				break;
+			}
+
+			std::chrono::milliseconds remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			executeRetrieve(*retrieve_command, unsigned(std::max<std::chrono::milliseconds::rep>(0, std::min(remaining, slice).count())), stereo, monocular);
+			if (!stereo && !monocular) break;
+
+			if (std::chrono::steady_clock::now() >= deadline) {
+				result.status = RetrieveResult::Status::timed_out;
+				break;
+			}
+		}
+
+		// The exposure is still on its way. Rather than waiting for it here, remember it,
+		// so it is collected and discarded before the next trigger and does not end up in the next retrieve.
+		pending_stereo    = stereo;
+		pending_monocular = monocular;
+	}
+
+	result.waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+	return result;
+}
+
+bool Ensenso::collectPendingCapture(std::chrono::steady_clock::time_point deadline, std::chrono::milliseconds slice) const {
+	while (pending_stereo || pending_monocular) {
+		if (retrieve_cancelled) return false;
 
-	if (stereo && !getNx<bool>(command.result()[serialNumber()][itmRetrieved])) return false;
-	if (monocular && !getNx<bool>(command.result()[monocularSerialNumber()][itmRetrieved])) return false;
+		std::chrono::milliseconds remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		executeRetrieve(*retrieve_command, unsigned(std::max<std::chrono::milliseconds::rep>(0, std::min(remaining, slice).count())), pending_stereo, pending_monocular);
+		if (!pending_stereo && !pending_monocular) break;
+
+		if (std::chrono::steady_clock::now() >= deadline) return false;
+	}
 	return true;
 }
 
-void Ensenso::rectifyImages() {
-	NxLibCommand command(cmdRectifyImages);
-	setNx(command.parameters()[itmCameras][0], serialNumber());
-	executeNx(command);
+void Ensenso::executeRetrieve(PreparedNxCommand & command, unsigned int timeout, bool & stereo, bool & monocular) const {
+	command.prepare(std::uint64_t(stereo) | std::uint64_t(monocular) << 1 | std::uint64_t(timeout) << 2, [&] (NxLibItem const & parameters) {
+		setNx(parameters[itmTimeout], int(timeout));
+		if (stereo) setNx(parameters[itmCameras][0], serial);
+		if (monocular) setNx(parameters[itmCameras][stereo ? 1 : 0], monocular_serial);
+	});
+	executeNx(command.command);
+
+	NxLibItem result = command.command.result();
+	if (stereo && getNx<bool>(result[serial][itmRetrieved])) stereo = false;
+	if (monocular && getNx<bool>(result[monocular_serial][itmRetrieved])) monocular = false;
 }
 
-cv::Size Ensenso::getIntensitySize() {
-	int width, height;
+std::future<bool> Ensenso::captureAsync(unsigned int timeout, bool stereo, bool monocular) {
+	bool triggered = trigger(stereo, monocular);
+	return runAsync([this, triggered, timeout, stereo, monocular] () {
+		return triggered && bool(retrieveUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout), false, stereo, monocular));
+	});
+}
 
-	try {
-		monocular_camera.get()[itmImages][itmRaw].getBinaryDataInfo(&width, &height, 0, 0, 0, 0);
-	} catch (NxLibException const & e) {
-		throw NxError(e);
+void Ensenso::queueAsync(std::function<void()> operation) {
+	std::lock_guard<std::mutex> lock(async_mutex);
+	async_queue.push_back(std::move(operation));
+	if (!async_thread.joinable()) async_thread = std::thread(&Ensenso::asyncLoop, this);
+	async_condition.notify_one();
+}
+
+void Ensenso::asyncLoop() {
+	std::unique_lock<std::mutex> lock(async_mutex);
+	while (true) {
+		async_condition.wait(lock, [this] () { return async_stop || !async_queue.empty(); });
+		if (async_queue.empty()) return;
+
+		std::function<void()> operation = std::move(async_queue.front());
+		async_queue.pop_front();
+
+		// Operations are packaged tasks, so exceptions end up in their futures.
+		lock.unlock();
+		operation();
+		lock.lock();
 	}
+}
 
-	return cv::Size(width, height);
+void Ensenso::rectifyImages() {
+	StageTimer timer(stage_timings.rectify);
+	rectify_command->prepare(0, [this] (NxLibItem const & parameters) {
+		setNx(parameters[itmCameras][0], serial);
+	});
+	executeNx(rectify_command->command);
+}
+
+void Ensenso::setConversionThreads(std::size_t threads) {
+	thread_pool.reset(threads == 0 ? nullptr : new ThreadPool(threads));
+}
+
+cv::Size Ensenso::getIntensitySize() {
+	if (monocular_camera) return imageSize(*monocular_camera, monocular_camera.get()[itmImages][itmRaw]);
+	return imageSize(ensenso_camera, rectified_left_item);
+}
+
+int Ensenso::getIntensityType() {
+	return monocular_camera ? CV_8UC3 : CV_8UC1;
 }
 
 cv::Size Ensenso::getPointCloudSize() {
-	int width, height;
-	ensenso_camera[itmImages][itmPointMap].getBinaryDataInfo(&width, &height, 0, 0, 0, 0);
-	return cv::Size(width, height);
+	return imageSize(ensenso_camera, point_map_item);
 }
 
-void Ensenso::loadIntensity(cv::Mat & intensity, bool capture) {
-	if (capture) this->retrieve(true, 1500, !monocular_camera, !!monocular_camera);
+RetrieveResult Ensenso::loadIntensity(cv::Mat & intensity, bool capture, unsigned int timeout) {
+	// Without new data the images in the tree are those of the previous capture, possibly with a different exposure, so leave intensity untouched.
+	RetrieveResult result;
+	if (capture) result = this->retrieveUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout), true, !monocular_camera, !!monocular_camera);
+	if (!result) return result;
 
 	// Copy to cv::Mat.
 	if (monocular_camera) {
-		intensity = toCvMat(monocular_camera.get()[itmImages][itmRaw]);
+		toCvMat(intensity, monocular_camera.get()[itmImages][itmRaw]);
 	} else {
 		rectifyImages();
-		intensity = toCvMat(ensenso_camera[itmImages][itmRectified][itmLeft]);
+		toCvMat(intensity, rectified_left_item);
 	}
+
+	return result;
 }
 
-void Ensenso::loadPointCloud(pcl::PointCloud<pcl::PointXYZ> & cloud, cv::Rect roi, bool capture) {
-	// Optionally capture new data.
-	if (capture) this->retrieve();
+RetrieveResult Ensenso::getFrame(Frame & frame, FrameOptions const & options) {
+	frame.captures            = 0;
+	frame.shared_exposure     = false;
+	frame.intensity_timestamp = 0;
+
+	// The result of the last capture, with the time spent waiting for all captures.
+	RetrieveResult result;
+	StageTimings first_capture;
+	auto capture = [&] (bool stereo, bool monocular) {
+		std::chrono::microseconds waited = result.waited;
+		++frame.captures;
+		result = retrieveUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(options.timeout), true, stereo, monocular);
+		result.waited += waited;
+		return bool(result);
+	};
 
+	// The monocular image is needed for the intensity image and for the texture of registered point clouds.
+	bool monocular = monocular_camera && (options.intensity || (options.registered && options.encoding == CloudEncoding::textured));
+	NxLibItem monocular_image;
+	if (monocular) monocular_image = monocular_camera.get()[itmImages][itmRaw];
+
+	if (options.intensity && !monocular_camera && !options.shared_exposure) {
+		// Capture the intensity image without projector pattern first.
+		CaptureSettings settings;
+		settings.flex_view = -1;
+		settings.projector = false;
+		if (options.front_light) settings.front_light = true;
+
+		{
+			ScopedCaptureSettings scoped_settings(*this, settings);
+			if (!capture(true, false)) return result;
+		}
+		rectifyImages();
+		toCvMat(frame.intensity, rectified_left_item);
+		frame.intensity_timestamp = getNxBinaryTimestamp(rectified_left_item);
+		first_capture = stage_timings;
+	} else if (monocular && !options.synced) {
+		// Capture the monocular camera first, so the projector pattern does not show in its image.
+		if (!capture(false, true)) return result;
+		first_capture = stage_timings;
+	}
+
+	if (!capture(true, monocular && options.synced)) return result;
+
+	computeDisparityMap(options.roi);
+	if (options.registered) {
+		renderPointMap();
+	} else {
+		computePointMap();
+	}
+
+	switch (options.encoding) {
+		case CloudEncoding::xyz:
+			convertPointCloud<pcl::PointXYZ>(frame.cloud, options.registered, options.cloud);
+			break;
+		case CloudEncoding::textured:
+			if (options.registered) {
+				convertPointCloud<pcl::PointXYZRGB>(frame.cloud, true, options.cloud);
+			} else {
+				convertPointCloud<pcl::PointXYZI>(frame.cloud, false, options.cloud);
+			}
+			break;
+		case CloudEncoding::compact:
+			convertCompactPointCloud(frame.cloud, options.registered, options.cloud);
+			break;
+	}
+	frame.cloud_timestamp = getNxBinaryTimestamp(options.registered ? render_point_map_item : point_map_item);
+
+	if (!options.intensity) {
+		frame.intensity = cv::Mat();
+	} else if (monocular_camera) {
+		toCvMat(frame.intensity, monocular_image);
+		frame.intensity_timestamp = getNxBinaryTimestamp(monocular_image);
+		frame.shared_exposure     = options.synced;
+	} else if (options.shared_exposure) {
+		// Computing the disparity map rectified the images of this capture already.
+		toCvMat(frame.intensity, rectified_left_item);
+		frame.intensity_timestamp = getNxBinaryTimestamp(rectified_left_item);
+		frame.shared_exposure     = true;
+	}
+
+	frame.timings          = stage_timings;
+	frame.timings.retrieve += first_capture.retrieve;
+	frame.timings.rectify  += first_capture.rectify;
+	return result;
+}
+
+void Ensenso::computeDisparityMap(cv::Rect roi) {
+	StageTimer timer(stage_timings.disparity);
+	tracking_region = adaptive_roi && roi.area() == 0;
+	if (tracking_region) roi = adaptive_roi->next();
+	else if (roi.area() == 0) roi = workspace_roi;
 	setRegionOfInterest(roi);
-	std::string serial = serialNumber();
+	disparity_command->prepare(0, [this] (NxLibItem const & parameters) {
+		setNx(parameters[itmCameras], serial);
+	});
+	executeNx(disparity_command->command);
+}
 
-	// Compute disparity.
-	{
-		NxLibCommand command(cmdComputeDisparityMap);
-		setNx(command.parameters()[itmCameras], serial);
-		executeNx(command);
+void Ensenso::computePointMap() {
+	StageTimer timer(stage_timings.point_map);
+	point_map_command->prepare(0, [this] (NxLibItem const & parameters) {
+		setNx(parameters[itmCameras], serial);
+	});
+	executeNx(point_map_command->command);
+}
+
+void Ensenso::renderPointMap() {
+	StageTimer timer(stage_timings.point_map);
+	render_command->prepare(0, [this] (NxLibItem const & parameters) {
+		setNx(parameters[itmNear], 1); // distance in millimeters to the camera (clip nothing?)
+		setNx(parameters[itmCamera], monocular_serial);
+	});
+	if (!render_prepared) {
+		// gives weird (RenderPointMap) results with OpenGL enabled, so disable
+		setNx(root[itmParameters][itmRenderPointMap][itmUseOpenGL], false);
+		render_prepared = true;
 	}
+	executeNx(render_command->command);
+}
 
-	// Compute point cloud.
-	{
-		NxLibCommand command(cmdComputePointMap);
-		setNx(command.parameters()[itmCameras], serial);
-		executeNx(command);
+template<typename Convert>
+void Ensenso::convertTracked(bool registered, PointCloudOptions const & options, Convert const & convert) {
+	StageTimer timer(stage_timings.conversion);
+	PointCloudOptions conversion = conversionOptions(options);
+
+	// The rendered point map is in the view of the monocular camera, so only the regular point map tells where the disparity map is valid.
+	bool track = tracking_region && !registered;
+	PointCloudStatistics statistics;
+	if (track && !conversion.statistics) conversion.statistics = &statistics;
+
+	convert(conversion);
+
+	if (track) {
+		adaptive_roi->update(conversion.statistics->region);
+		tracking_region = false;
 	}
+}
 
-	// Convert the binary data to a point cloud.
-	cloud = toPointCloud(ensenso_camera[itmImages][itmPointMap]);
+template<typename Point>
+void Ensenso::convertPointCloud(pcl::PointCloud<Point> & cloud, bool registered, PointCloudOptions const & options, std::vector<int> * indices) {
+	convertTracked(registered, options, [&] (PointCloudOptions const & conversion) {
+		toPointCloud(cloud, registered ? render_point_map_item : point_map_item, pointMapTexture(registered, hasTexture<Point>()), conversion, indices);
+	});
 }
 
-void Ensenso::loadRegisteredPointCloud(pcl::PointCloud<pcl::PointXYZ> & cloud, cv::Rect roi, bool capture) {
+template<typename Point>
+void Ensenso::convertPointCloud(sensor_msgs::PointCloud2 & cloud, bool registered, PointCloudOptions const & options, std::vector<int> * indices) {
+	convertTracked(registered, options, [&] (PointCloudOptions const & conversion) {
+		toPointCloud2<Point>(cloud, registered ? render_point_map_item : point_map_item, pointMapTexture(registered, hasTexture<Point>()), conversion, indices);
+	});
+}
+
+void Ensenso::convertCompactPointCloud(sensor_msgs::PointCloud2 & cloud, bool registered, PointCloudOptions const & options, std::vector<int> * indices) {
+	convertTracked(registered, options, [&] (PointCloudOptions const & conversion) {
+		toCompactPointCloud2(cloud, registered ? render_point_map_item : point_map_item, conversion, indices);
+	});
+}
+
+void Ensenso::setAdaptiveRoi(boost::optional<AdaptiveRoiOptions> const & options) {
+	tracking_region = false;
+	if (options) {
+		adaptive_roi.reset(new AdaptiveRoi(getPointCloudSize(), *options));
+		adaptive_roi->setBounds(workspace_roi);
+	} else {
+		adaptive_roi.reset();
+	}
+}
+
+void Ensenso::loadPointMap(cv::Rect roi, bool capture) {
 	// Optionally capture new data.
 	if (capture) this->retrieve();
+	computeDisparityMap(roi);
+	computePointMap();
+}
 
-	setRegionOfInterest(roi);
-	std::string serial = serialNumber();
+void Ensenso::loadRegisteredPointMap(cv::Rect roi, bool capture) {
+	// Optionally capture new data.
+	if (capture) this->retrieve();
+	computeDisparityMap(roi);
+	renderPointMap();
+}
 
-	// Compute disparity.
-	{
-		NxLibCommand command(cmdComputeDisparityMap);
-		setNx(command.parameters()[itmCameras], serial);
-		executeNx(command);
-	}
+cv::Mat Ensenso::pointMapTexture(bool registered, bool textured) {
+	if (!textured) return cv::Mat();
 
-	// Render point cloud.
-	{
-		NxLibCommand command(cmdRenderPointMap);
-		setNx(command.parameters()[itmNear], 1); // distance in millimeters to the camera (clip nothing?)
-		setNx(command.parameters()[itmCamera], monocularSerialNumber());
-		// gives weird (RenderPointMap) results with OpenGL enabled, so disable
-		setNx(root[itmParameters][itmRenderPointMap][itmUseOpenGL], false);
-		executeNx(command);
+	// The registered point map is rendered from the view point of the monocular camera, so it matches the monocular image.
+	if (registered) {
+		if (!monocular_camera) throw std::runtime_error("No monocular camera found. Can not texture a registered point cloud.");
+		return toCvMat(monocular_camera.get()[itmImages][itmRaw]);
 	}
 
-	// Convert the binary data to a point cloud.
-	cloud = toPointCloud(root[itmImages][itmRenderPointMap]);
+	// Computing the disparity map also rectifies the images, so the rectified left image matches the point map.
+	return toCvMat(rectified_left_item);
+}
+
+template<typename Point>
+void Ensenso::loadPointCloud(pcl::PointCloud<Point> & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices) {
+	loadPointMap(roi, capture);
+	convertPointCloud(cloud, false, options, indices);
+}
+
+template<typename Point>
+void Ensenso::loadPointCloud(sensor_msgs::PointCloud2 & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices) {
+	loadPointMap(roi, capture);
+	convertPointCloud<Point>(cloud, false, options, indices);
+}
+
+template<typename Point>
+void Ensenso::loadRegisteredPointCloud(pcl::PointCloud<Point> & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices) {
+	loadRegisteredPointMap(roi, capture);
+	convertPointCloud(cloud, true, options, indices);
+}
+
+template<typename Point>
+void Ensenso::loadRegisteredPointCloud(sensor_msgs::PointCloud2 & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices) {
+	loadRegisteredPointMap(roi, capture);
+	convertPointCloud<Point>(cloud, true, options, indices);
+}
+
+void Ensenso::loadCompactPointCloud(sensor_msgs::PointCloud2 & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices) {
+	loadPointMap(roi, capture);
+	convertCompactPointCloud(cloud, false, options, indices);
+}
+
+void Ensenso::loadRegisteredCompactPointCloud(sensor_msgs::PointCloud2 & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices) {
+	loadRegisteredPointMap(roi, capture);
+	convertCompactPointCloud(cloud, true, options, indices);
+}
+
+template void Ensenso::loadPointCloud<pcl::PointXYZ>(pcl::PointCloud<pcl::PointXYZ> & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices);
+template void Ensenso::loadPointCloud<pcl::PointXYZI>(pcl::PointCloud<pcl::PointXYZI> & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices);
+template void Ensenso::loadPointCloud<pcl::PointXYZRGB>(pcl::PointCloud<pcl::PointXYZRGB> & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices);
+template void Ensenso::loadPointCloud<pcl::PointXYZ>(sensor_msgs::PointCloud2 & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices);
+template void Ensenso::loadPointCloud<pcl::PointXYZI>(sensor_msgs::PointCloud2 & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices);
+template void Ensenso::loadPointCloud<pcl::PointXYZRGB>(sensor_msgs::PointCloud2 & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices);
+template void Ensenso::loadRegisteredPointCloud<pcl::PointXYZ>(pcl::PointCloud<pcl::PointXYZ> & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices);
+template void Ensenso::loadRegisteredPointCloud<pcl::PointXYZI>(pcl::PointCloud<pcl::PointXYZI> & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices);
+template void Ensenso::loadRegisteredPointCloud<pcl::PointXYZRGB>(pcl::PointCloud<pcl::PointXYZRGB> & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices);
+template void Ensenso::loadRegisteredPointCloud<pcl::PointXYZ>(sensor_msgs::PointCloud2 & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices);
+template void Ensenso::loadRegisteredPointCloud<pcl::PointXYZI>(sensor_msgs::PointCloud2 & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices);
+template void Ensenso::loadRegisteredPointCloud<pcl::PointXYZRGB>(sensor_msgs::PointCloud2 & cloud, PointCloudOptions const & options, cv::Rect roi, bool capture, std::vector<int> * indices);
+template void Ensenso::convertPointCloud<pcl::PointXYZ>(pcl::PointCloud<pcl::PointXYZ> & cloud, bool registered, PointCloudOptions const & options, std::vector<int> * indices);
+template void Ensenso::convertPointCloud<pcl::PointXYZI>(pcl::PointCloud<pcl::PointXYZI> & cloud, bool registered, PointCloudOptions const & options, std::vector<int> * indices);
+template void Ensenso::convertPointCloud<pcl::PointXYZRGB>(pcl::PointCloud<pcl::PointXYZRGB> & cloud, bool registered, PointCloudOptions const & options, std::vector<int> * indices);
+template void Ensenso::convertPointCloud<pcl::PointXYZ>(sensor_msgs::PointCloud2 & cloud, bool registered, PointCloudOptions const & options, std::vector<int> * indices);
+template void Ensenso::convertPointCloud<pcl::PointXYZI>(sensor_msgs::PointCloud2 & cloud, bool registered, PointCloudOptions const & options, std::vector<int> * indices);
+template void Ensenso::convertPointCloud<pcl::PointXYZRGB>(sensor_msgs::PointCloud2 & cloud, bool registered, PointCloudOptions const & options, std::vector<int> * indices);
+
+void Ensenso::invalidateParameterCache() {
+	applied_roi    = boost::none;
+	known_settings = CaptureSettings();
+	active_profile.clear();
+}
+
+void Ensenso::reapplyWorkspaceVolume() {
+	if (!workspace_disparity_range) return;
+
+	NxLibItem stereo_matching = ensenso_camera[itmParameters][itmDisparityMap][itmStereoMatching];
+	default_disparity_range = std::make_pair(getNx<int>(stereo_matching[itmMinimumDisparity]), getNx<int>(stereo_matching[itmNumberOfDisparities]));
+	setNx(stereo_matching[itmMinimumDisparity],    workspace_disparity_range->first);
+	setNx(stereo_matching[itmNumberOfDisparities], workspace_disparity_range->second);
+}
+
+PointCloudOptions Ensenso::conversionOptions(PointCloudOptions options) const {
+	if (!options.thread_pool) options.thread_pool = thread_pool.get();
+	return options;
 }
 
 void Ensenso::setRegionOfInterest(cv::Rect const & roi) {
+	// Only touch the tree when the region of interest changes.
+	cv::Rect normalized = roi.area() == 0 ? cv::Rect() : roi;
+	if (applied_roi && *applied_roi == normalized) return;
+	applied_roi = boost::none;
+
 	if (roi.area() == 0) {
 		setNx(ensenso_camera[itmParameters][itmCapture][itmUseDisparityMapAreaOfInterest], false);
 
+		countNxTreeAccess();
 		if (ensenso_camera[itmParameters][itmDisparityMap][itmAreaOfInterest].exists()) {
+			countNxTreeAccess();
 			ensenso_camera[itmParameters][itmDisparityMap][itmAreaOfInterest].erase();
 		}
 	} else {
@@ -212,6 +748,8 @@ void Ensenso::setRegionOfInterest(cv::Rect const & roi) {
 		setNx(ensenso_camera[itmParameters][itmDisparityMap][itmAreaOfInterest][itmRightBottom][0], roi.br().x);
 		setNx(ensenso_camera[itmParameters][itmDisparityMap][itmAreaOfInterest][itmRightBottom][1], roi.br().y);
 	}
+
+	applied_roi = normalized;
 }
 
 void Ensenso::discardCalibrationPatterns() {
@@ -219,18 +757,15 @@ void Ensenso::discardCalibrationPatterns() {
 }
 
 void Ensenso::recordCalibrationPattern() {
-	// disable FlexView
-	int flex_view = flexView();
-	if (flex_view > 0) setFlexView(0);
-
-	// Capture image with front-light.
-	setProjector(false);
-	setFrontLight(true);
-
-	retrieve(true, 1500, true, false);
-
-	setFrontLight(false);
-	setProjector(true);
+	// Capture image with front-light and without FlexView.
+	{
+		CaptureSettings settings;
+		settings.flex_view   = -1;
+		settings.projector   = false;
+		settings.front_light = true;
+		ScopedCaptureSettings scoped(*this, settings);
+		retrieve(true, 1500, true, false);
+	}
 
 	// Find the pattern.
 	NxLibCommand command_collect_pattern(cmdCollectPattern);
@@ -238,11 +773,6 @@ void Ensenso::recordCalibrationPattern() {
 	setNx(command_collect_pattern.parameters()[itmDecodeData], true);
 
 	executeNx(command_collect_pattern);
-
-	// restore FlexView setting
-	if (flex_view > 0) {
-		setFlexView(flex_view);
-	}
 }
 
 Eigen::Isometry3d Ensenso::detectCalibrationPattern(int const samples, bool ignore_calibration)  {
@@ -399,4 +929,70 @@ void Ensenso::storeWorkspaceCalibration() {
 	executeNx(command);
 }
 
+cv::Rect Ensenso::setWorkspaceVolume(Eigen::AlignedBox3d const & volume) {
+	if (volume.isEmpty()) throw std::runtime_error("Workspace volume is empty.");
+
+	// The point map is given in the calibrated frame, but the disparity map lives in the rectified left camera.
+	NxLibItem calibration = ensenso_camera[itmCalibration];
+	Eigen::Isometry3d workspace_to_camera = getWorkspaceCalibration().get_value_or(Eigen::Isometry3d::Identity()).inverse();
+	Eigen::Matrix3d rectification = toEigenMatrix<3, 3>(calibration[itmStereo][itmLeft][itmRotation]);
+	Eigen::Matrix3d camera_matrix = toEigenMatrix<3, 3>(calibration[itmStereo][itmLeft][itmCamera]);
+
+	double min_x = std::numeric_limits<double>::infinity(), max_x = -min_x;
+	double min_y = min_x, max_y = max_x;
+	double near  = min_x, far   = max_x;
+	for (int i = 0; i < 8; ++i) {
+		Eigen::Vector3d corner = rectification * (workspace_to_camera * volume.corner(Eigen::AlignedBox3d::CornerType(i)));
+		if (corner.z() <= 0) throw std::runtime_error("Workspace volume is not entirely in front of the camera.");
+
+		Eigen::Vector2d pixel = (camera_matrix * corner).hnormalized();
+		min_x = std::min(min_x, pixel.x());
+		max_x = std::max(max_x, pixel.x());
+		min_y = std::min(min_y, pixel.y());
+		max_y = std::max(max_y, pixel.y());
+		near  = std::min(near, corner.z());
+		far   = std::max(far,  corner.z());
+	}
+
+	// Round outwards, since a pixel is in the region when any part of it sees the box.
+	cv::Size size = getPointCloudSize();
+	cv::Rect roi = cv::Rect(cv::Point(std::floor(min_x), std::floor(min_y)), cv::Point(std::ceil(max_x) + 1, std::ceil(max_y) + 1)) & cv::Rect(cv::Point(0, 0), size);
+	if (roi.area() == 0) throw std::runtime_error("Workspace volume is outside the view of the camera.");
+
+	// Disparity is inversely proportional to depth. The reprojection matrix tells the sign convention of the disparity.
+	NxLibItem stereo_matching = ensenso_camera[itmParameters][itmDisparityMap][itmStereoMatching];
+	if (!default_disparity_range) {
+		default_disparity_range = std::make_pair(getNx<int>(stereo_matching[itmMinimumDisparity]), getNx<int>(stereo_matching[itmNumberOfDisparities]));
+	}
+	double focal_baseline = camera_matrix(0, 0) * getNx<double>(calibration[itmStereo][itmBaseline]) / 1000.0;
+	double sign           = getNx<double>(calibration[itmStereo][itmReprojection][2][3]) < 0 ? -1 : 1;
+	double first          = sign * focal_baseline / (sign > 0 ? far : near);
+	double last           = sign * focal_baseline / (sign > 0 ? near : far);
+
+	// Stereo matching needs the number of disparities to be a multiple of 16. Keep a pixel of slack on both sides.
+	int minimum_disparity     = int(std::floor(first)) - 1;
+	int number_of_disparities = int(std::ceil(last)) + 2 - minimum_disparity;
+	number_of_disparities     = (number_of_disparities + 15) / 16 * 16;
+	setNx(stereo_matching[itmMinimumDisparity],    minimum_disparity);
+	setNx(stereo_matching[itmNumberOfDisparities], number_of_disparities);
+	workspace_disparity_range = std::make_pair(minimum_disparity, number_of_disparities);
+
+	workspace_roi = roi;
+	if (adaptive_roi) adaptive_roi->setBounds(workspace_roi);
+	return workspace_roi;
+}
+
+void Ensenso::clearWorkspaceVolume() {
+	workspace_roi = cv::Rect();
+	if (adaptive_roi) adaptive_roi->setBounds(workspace_roi);
+
+	workspace_disparity_range = boost::none;
+	if (default_disparity_range) {
+		NxLibItem stereo_matching = ensenso_camera[itmParameters][itmDisparityMap][itmStereoMatching];
+		setNx(stereo_matching[itmMinimumDisparity],    default_disparity_range->first);
+		setNx(stereo_matching[itmNumberOfDisparities], default_disparity_range->second);
+		default_disparity_range = boost::none;
+	}
+}
+
 }
@@ -0,0 +1,46 @@
+#include "ensenso_group.hpp"
+#include "util.hpp"
+
+#include <stdexcept>
+
+namespace dr {
+
+EnsensoGroup::EnsensoGroup(std::vector<std::string> const & serials, bool connect_monocular) {
+	if (serials.empty()) throw std::runtime_error("No camera serials given for Ensenso group.");
+
+	std::string slot = "dr_ensenso_group";
+	for (std::string const & serial : serials) {
+		cameras.emplace_back(new Ensenso(serial, connect_monocular));
+		slot += "_" + serial;
+	}
+
+	pool.reset(new ThreadPool(cameras.size()));
+	capture_command.reset(new PreparedNxCommand(cmdCapture, slot));
+}
+
+bool EnsensoGroup::capture(unsigned int timeout, bool stereo, bool monocular) {
+	capture_command->prepare(std::uint64_t(stereo) | std::uint64_t(monocular) << 1 | std::uint64_t(timeout) << 2, [&] (NxLibItem const & parameters) {
+		setNx(parameters[itmTimeout], int(timeout));
+		int index = 0;
+		for (std::unique_ptr<Ensenso> const & camera : cameras) {
+			if (stereo) setNx(parameters[itmCameras][index++], camera->serialNumber());
+			if (monocular && camera->hasMonocular()) setNx(parameters[itmCameras][index++], camera->monocularSerialNumber());
+		}
+	});
+	executeNx(capture_command->command);
+
+	NxLibItem result = capture_command->command.result();
+	for (std::unique_ptr<Ensenso> const & camera : cameras) {
+		if (stereo && !getNx<bool>(result[camera->serialNumber()][itmRetrieved])) return false;
+		if (monocular && camera->hasMonocular() && !getNx<bool>(result[camera->monocularSerialNumber()][itmRetrieved])) return false;
+	}
+	return true;
+}
+
+void EnsensoGroup::forEach(std::function<void (Ensenso & camera, std::size_t index)> const & function) {
+	pool->parallelFor(cameras.size(), [this, &function] (std::size_t index) {
+		function(*cameras[index], index);
+	});
+}
+
+}
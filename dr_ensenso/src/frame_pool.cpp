@@ -0,0 +1,55 @@
+#include "frame_pool.hpp"
+
+namespace dr {
+
+namespace {
+	/// Check if the data of an image is referenced by a single cv::Mat.
+	bool isUnique(cv::Mat const & image) {
+#if CV_MAJOR_VERSION >= 3
+		return image.u && image.u->refcount == 1;
+#else
+		return image.refcount && *image.refcount == 1;
+#endif
+	}
+}
+
+ImagePool::ImagePool(std::size_t capacity) : capacity(capacity) {}
+
+void ImagePool::reserve(cv::Size size, int type) {
+	std::lock_guard<std::mutex> lock(mutex);
+	this->size = size;
+	this->type = type;
+	images.resize(capacity);
+	for (cv::Mat & image : images) {
+		if (image.empty() || isUnique(image)) image.create(size, type);
+	}
+}
+
+cv::Mat ImagePool::get() {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (cv::Mat & image : images) {
+		if (image.empty() || isUnique(image)) {
+			image.create(size, type);
+			return image;
+		}
+	}
+
+	cv::Mat image(size, type);
+	if (images.size() < capacity) images.push_back(image);
+	return image;
+}
+
+PointCloud2Pool::PointCloud2Pool(std::size_t capacity) : capacity(capacity) {}
+
+sensor_msgs::PointCloud2Ptr PointCloud2Pool::get() {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (sensor_msgs::PointCloud2Ptr const & cloud : clouds) {
+		if (cloud.use_count() == 1) return cloud;
+	}
+
+	sensor_msgs::PointCloud2Ptr cloud(new sensor_msgs::PointCloud2);
+	if (clouds.size() < capacity) clouds.push_back(cloud);
+	return cloud;
+}
+
+}
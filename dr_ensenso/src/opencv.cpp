@@ -6,8 +6,15 @@
 namespace dr {
 
 cv::Mat toCvMat(NxLibItem const & item, std::string const & what) {
-	int error = 0;
 	cv::Mat result;
+	toCvMat(result, item, what);
+	return result;
+}
+
+void toCvMat(cv::Mat & result, NxLibItem const & item, std::string const & what) {
+	int error = 0;
+	// NxLib allocates the data with cv::Mat::create, so an existing buffer of the right size and type is reused.
+	countNxTreeAccess();
 	item.getBinaryData(&error, result, nullptr);
 	if (error) throw NxError(item, error, what);
 
@@ -15,7 +22,6 @@ cv::Mat toCvMat(NxLibItem const & item, std::string const & what) {
 	if (result.channels() == 3) {
 		cv::cvtColor(result, result, cv::COLOR_RGB2BGR);
 	}
-	return result;
 }
 
 cv::Mat toCameraMatrix(NxLibItem const & item, std::string const & what) {
@@ -1,53 +1,741 @@
 #include "pcl.hpp"
+#include "point_map.hpp"
+#include "thread_pool.hpp"
 #include "util.hpp"
 
+#include <pcl/conversions.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
 #include <stdexcept>
+#include <utility>
 
 namespace dr {
 
 namespace {
 	/// Conversion from ensenso timestamp to PCL timestamp.
 	pcl::uint64_t ensensoStampToPcl(double stamp) { return (stamp - 11644473600.0) * 1000000.0; };
+
+	/// Metadata of a point map.
+	struct PointMapInfo {
+		int width;
+		int height;
+		double timestamp;
+
+		std::size_t size() const { return std::size_t(width) * height; }
+	};
+
+	/// Get and check the metadata of a point map.
+	PointMapInfo getPointMapInfo(NxLibItem const & item, std::string const & what) {
+		int error = 0;
+
+		// Retrieve metadata.
+		PointMapInfo info;
+		int channels, element_width;
+		bool is_float;
+		countNxTreeAccess();
+		item.getBinaryDataInfo(&error, &info.width, &info.height, &channels, &element_width, &is_float, &info.timestamp);
+		if (error) throw NxError(item, error, what);
+
+		// Make sure data is what we expect.
+		std::string what2 = what.empty() ? std::string() : ": " + what;
+		if (channels != 3) throw std::runtime_error("Unexpected number of channels: " + std::to_string(channels) + ", expected 3" + what2 + ".");
+		if (!is_float) throw std::runtime_error("Expected floating point data for point cloud conversion" + what2 + ".");
+		if (element_width != 4) throw std::runtime_error("Unexpected data width: " + std::to_string(element_width) + ", expected 4" + what2 + ".");
+
+		return info;
+	}
+
+	/// Check that a texture can be used for a point map.
+	void checkTexture(cv::Mat const & texture, PointMapInfo const & info, std::string const & what) {
+		if (texture.empty()) return;
+
+		std::string what2 = what.empty() ? std::string() : ": " + what;
+		if (texture.depth() != CV_8U || (texture.channels() != 1 && texture.channels() != 3)) {
+			throw std::runtime_error("Unexpected texture format, expected an 8 bit grayscale or BGR image" + what2 + ".");
+		}
+		if (texture.cols != info.width || texture.rows != info.height) {
+			throw std::runtime_error("Texture size does not match point map size" + what2 + ".");
+		}
+	}
+
+	/// Retrieve the packed XYZ data of a point map into a buffer that can hold at least info.size() * 3 floats.
+	float * retrievePointMap(NxLibItem const & item, PointMapInfo const & info, void * buffer, std::string const & what) {
+		int error  = 0;
+		int copied = 0;
+		int bytes  = int(info.size() * 3 * sizeof(float));
+		float * data = reinterpret_cast<float *>(buffer);
+		countNxTreeAccess();
+		item.getBinaryData(&error, data, bytes, &copied, nullptr);
+		if (error) throw NxError(item, error, what);
+
+		std::string what2 = what.empty() ? std::string() : ": " + what;
+		if (copied != bytes) throw std::runtime_error("Unexpected amount of point data: " + std::to_string(copied) + " bytes, expected " + std::to_string(bytes) + what2 + ".");
+		return data;
+	}
+
+	/// Set the texture of a point (no-op for points without texture).
+	void setTexture(pcl::PointXYZ &, std::uint8_t const *, int) {}
+
+	/// Set the intensity of a point from a grayscale or BGR pixel.
+	void setTexture(pcl::PointXYZI & point, std::uint8_t const * pixel, int channels) {
+		point.intensity = channels == 1 ? pixel[0] : 0.114f * pixel[0] + 0.587f * pixel[1] + 0.299f * pixel[2];
+	}
+
+	/// Set the color of a point from a grayscale or BGR pixel.
+	void setTexture(pcl::PointXYZRGB & point, std::uint8_t const * pixel, int channels) {
+		point.b = pixel[0];
+		point.g = pixel[channels == 1 ? 0 : 1];
+		point.r = pixel[channels == 1 ? 0 : 2];
+	}
+
+	/// Make a point from coordinates in meters and an optional texture pixel.
+	template<typename Point>
+	Point makePoint(float const * xyz, std::uint8_t const * pixel, int channels) {
+		Point point;
+		point.x = xyz[0];
+		point.y = xyz[1];
+		point.z = xyz[2];
+		if (pixel) setTexture(point, pixel, channels);
+		return point;
+	}
+
+	/// Get a pointer to a pixel of a texture, or null if the texture is empty.
+	std::uint8_t const * texturePixel(cv::Mat const & texture, int row, int col) {
+		return texture.empty() ? nullptr : texture.ptr<std::uint8_t>(row) + col * texture.channels();
+	}
+
+	/// Convert an affine transformation to a row major 3x4 float matrix.
+	void toMatrix(Eigen::Isometry3d const & transform, float * matrix) {
+		for (int row = 0; row < 3; ++row) {
+			for (int col = 0; col < 4; ++col) matrix[row * 4 + col] = transform(row, col);
+		}
+	}
+
+	/// Get the geometric part of a conversion from the options.
+	PointMapTransform makeTransform(PointCloudOptions const & options) {
+		PointMapTransform transform;
+		if (options.transform) {
+			transform.transformed = true;
+			toMatrix(*options.transform, transform.matrix);
+		}
+		if (options.crop_box) {
+			transform.cropped = true;
+			toMatrix(options.crop_box->pose.inverse(), transform.crop_matrix);
+			for (int axis = 0; axis < 3; ++axis) {
+				transform.crop_min[axis] = options.crop_box->min[axis];
+				transform.crop_max[axis] = options.crop_box->max[axis];
+			}
+		}
+		return transform;
+	}
+
+	/// Grid of pixels that are sampled from a decimated point map.
+	struct SampleGrid {
+		int step;
+		int width;
+		int height;
+
+		SampleGrid(PointMapInfo const & info, int step) :
+			step(step),
+			width((info.width + step - 1) / step),
+			height((info.height + step - 1) / step) {}
+
+		std::size_t size() const { return std::size_t(width) * height; }
+
+		/// Get the index in the point map of a sampled pixel.
+		std::size_t index(PointMapInfo const & info, int row, int col) const {
+			return std::size_t(row) * step * info.width + std::size_t(col) * step;
+		}
+	};
+
+	/// Convert rows [begin, end) of packed XYZ data in millimeters to transformed points in meters, sampling a texture in the same pass.
+	/**
+	 * Points are processed back to front, so the conversion can be done in place.
+	 *
+	 * \return The number of valid points.
+	 */
+	template<typename Point>
+	std::size_t convertTextured(float const * input, Point * output, PointMapInfo const & info, PointMapTransform const & transform, cv::Mat const & texture, int begin, int end) {
+		std::size_t valid = 0;
+		for (int row = end; row-- > begin;) {
+			for (int col = info.width; col-- > 0;) {
+				std::size_t i = std::size_t(row) * info.width + col;
+				float xyz[3];
+				valid += transform.apply(input + i * 3, xyz);
+				output[i] = makePoint<Point>(xyz, texturePixel(texture, row, col), texture.channels());
+			}
+		}
+		return valid;
+	}
+
+	/// Convert rows [begin, end) of packed XYZ data in millimeters to transformed points in meters.
+	/**
+	 * Plain XYZ points have no texture, so they use the vectorized kernels.
+	 */
+	std::size_t convertTextured(float const * input, pcl::PointXYZ * output, PointMapInfo const & info, PointMapTransform const & transform, cv::Mat const &, int begin, int end) {
+		std::size_t offset = std::size_t(begin) * info.width;
+		std::size_t count  = std::size_t(end - begin) * info.width;
+		if (transform.scaleOnly()) return convertPointMap(input + offset * 3, output + offset, count, transform.divisor);
+		return convertPointMap(input + offset * 3, output + offset, count, transform);
+	}
+
+	/// Get the staging buffer of the calling thread for conversions that can not be done in place.
+	std::vector<float> & stagingBuffer() {
+		static thread_local std::vector<float> buffer;
+		return buffer;
+	}
+
+	/// Get the thread pool to use for a conversion.
+	ThreadPool & threadPool(PointCloudOptions const & options) {
+		return options.thread_pool ? *options.thread_pool : defaultThreadPool();
+	}
+
+	/// Get the number of chunks to split a conversion of a number of rows in.
+	std::size_t chunkCount(ThreadPool const & pool, int rows) {
+		return std::min<std::size_t>(pool.size(), std::max(rows, 1));
+	}
+
+	/// Get the first row of a chunk.
+	int chunkBegin(int rows, std::size_t chunks, std::size_t chunk) {
+		return int(std::size_t(rows) * chunk / chunks);
+	}
+
+	/// Get the bounding box in point map pixels of the sampled pixels with a valid point.
+	/**
+	 * Each row is only scanned from both ends up to its first valid point, and the rows are split in parallel chunks.
+	 *
+	 * \param z Function giving the z coordinate of a sampled pixel by row and column in the sample grid.
+	 */
+	template<typename Z>
+	cv::Rect validRegion(SampleGrid const & grid, ThreadPool & pool, Z const & z) {
+		struct Bounds {
+			int min_row = std::numeric_limits<int>::max();
+			int max_row = -1;
+			int min_col = std::numeric_limits<int>::max();
+			int max_col = -1;
+		};
+
+		std::size_t chunks = chunkCount(pool, grid.height);
+		std::vector<Bounds> bounds(chunks);
+		pool.parallelFor(chunks, [&] (std::size_t chunk) {
+			Bounds & result = bounds[chunk];
+			for (int row = chunkBegin(grid.height, chunks, chunk); row < chunkBegin(grid.height, chunks, chunk + 1); ++row) {
+				int first = 0;
+				while (first < grid.width && std::isnan(z(row, first))) ++first;
+				if (first == grid.width) continue;
+
+				int last = grid.width - 1;
+				while (last > first && std::isnan(z(row, last))) --last;
+
+				result.min_row = std::min(result.min_row, row);
+				result.max_row = row;
+				result.min_col = std::min(result.min_col, first);
+				result.max_col = std::max(result.max_col, last);
+			}
+		});
+
+		Bounds total;
+		for (Bounds const & chunk : bounds) {
+			total.min_row = std::min(total.min_row, chunk.min_row);
+			total.max_row = std::max(total.max_row, chunk.max_row);
+			total.min_col = std::min(total.min_col, chunk.min_col);
+			total.max_col = std::max(total.max_col, chunk.max_col);
+		}
+		if (total.max_row < 0) return cv::Rect();
+		return cv::Rect(
+			total.min_col * grid.step,
+			total.min_row * grid.step,
+			(total.max_col - total.min_col) * grid.step + 1,
+			(total.max_row - total.min_row) * grid.step + 1
+		);
+	}
+
+	/// Convert the sampled pixels of a packed point map into an organized point cloud.
+	/**
+	 * The rows are split in chunks that are converted in parallel.
+	 *
+	 * \return The number of valid points.
+	 */
+	template<typename Point, typename Storage>
+	std::size_t decimatePointMap(float const * input, Storage & storage, PointMapInfo const & info, SampleGrid const & grid, PointMapTransform const & transform, cv::Mat const & texture, ThreadPool & pool, std::vector<int> * indices) {
+		Point * points = storage.resize(grid.size());
+		if (indices) indices->resize(grid.size());
+
+		std::size_t chunks = chunkCount(pool, grid.height);
+		std::vector<std::size_t> valid(chunks, 0);
+		pool.parallelFor(chunks, [&] (std::size_t chunk) {
+			for (int row = chunkBegin(grid.height, chunks, chunk); row < chunkBegin(grid.height, chunks, chunk + 1); ++row) {
+				for (int col = 0; col < grid.width; ++col) {
+					std::size_t i      = grid.index(info, row, col);
+					std::size_t output = std::size_t(row) * grid.width + col;
+					float xyz[3];
+					valid[chunk] += transform.apply(input + i * 3, xyz);
+					points[output] = makePoint<Point>(xyz, texturePixel(texture, row * grid.step, col * grid.step), texture.channels());
+					if (indices) (*indices)[output] = i;
+				}
+			}
+		});
+
+		std::size_t total = 0;
+		for (std::size_t count : valid) total += count;
+		return total;
+	}
+
+	/// Compact the valid sampled points of a packed point map into a dense point cloud.
+	/**
+	 * The rows are split in chunks that are counted in parallel.
+	 * Afterwards each chunk copies its valid points to its own range of the output, also in parallel.
+	 *
+	 * \return The number of valid points.
+	 */
+	template<typename Point, typename Storage>
+	std::size_t compactPointMap(float const * input, Storage & storage, PointMapInfo const & info, SampleGrid const & grid, PointMapTransform const & transform, cv::Mat const & texture, ThreadPool & pool, std::vector<int> * indices) {
+		std::size_t chunks = chunkCount(pool, grid.height);
+		auto chunk_begin   = [&] (std::size_t chunk) { return chunkBegin(grid.height, chunks, chunk); };
+
+		// Count the valid points in each chunk.
+		std::vector<std::size_t> offsets(chunks + 1, 0);
+		pool.parallelFor(chunks, [&] (std::size_t chunk) {
+			std::size_t valid = 0;
+			for (int row = chunk_begin(chunk); row < chunk_begin(chunk + 1); ++row) {
+				for (int col = 0; col < grid.width; ++col) {
+					float xyz[3];
+					valid += transform.apply(input + grid.index(info, row, col) * 3, xyz);
+				}
+			}
+			offsets[chunk + 1] = valid;
+		});
+		for (std::size_t chunk = 0; chunk < chunks; ++chunk) offsets[chunk + 1] += offsets[chunk];
+
+		Point * points = storage.resize(offsets[chunks]);
+		if (indices) indices->resize(offsets[chunks]);
+
+		// Copy the valid points of each chunk to their final location.
+		pool.parallelFor(chunks, [&] (std::size_t chunk) {
+			std::size_t output = offsets[chunk];
+			for (int row = chunk_begin(chunk); row < chunk_begin(chunk + 1); ++row) {
+				for (int col = 0; col < grid.width; ++col) {
+					std::size_t i = grid.index(info, row, col);
+					float xyz[3];
+					if (!transform.apply(input + i * 3, xyz)) continue;
+					points[output] = makePoint<Point>(xyz, texturePixel(texture, row * grid.step, col * grid.step), texture.channels());
+					if (indices) (*indices)[output] = i;
+					++output;
+				}
+			}
+		});
+
+		return offsets[chunks];
+	}
+
+	/// Get the voxel buffer of the calling thread, holding voxel keys and point map indices.
+	std::vector<std::pair<std::uint64_t, std::uint32_t>> & voxelBuffer() {
+		static thread_local std::vector<std::pair<std::uint64_t, std::uint32_t>> buffer;
+		return buffer;
+	}
+
+	/// Reduce the valid sampled points of a packed point map to the centroid of each occupied voxel.
+	/**
+	 * Like pcl::VoxelGrid, the voxels are aligned to the minimum of the bounding box of the valid points.
+	 * The voxels are taken in the frame of the transformed points, and cropped points are ignored.
+	 * The points are sorted by voxel, and each run of points in the same voxel is averaged, including the texture.
+	 *
+	 * \param valid Receives the number of valid sampled points.
+	 * \return The number of occupied voxels.
+	 */
+	template<typename Point, typename Storage>
+	std::size_t voxelizePointMap(
+		float const * input,
+		Storage & storage,
+		PointMapInfo const & info,
+		SampleGrid const & grid,
+		PointMapTransform const & transform,
+		cv::Mat const & texture,
+		double voxel_size,
+		std::vector<int> * indices,
+		std::size_t & valid,
+		std::string const & what
+	) {
+		double leaf = voxel_size;
+
+		// Find the bounding box of the valid points.
+		float min[3] = { INFINITY,  INFINITY,  INFINITY};
+		float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+		for (int row = 0; row < grid.height; ++row) {
+			for (int col = 0; col < grid.width; ++col) {
+				float xyz[3];
+				if (!transform.apply(input + grid.index(info, row, col) * 3, xyz)) continue;
+				for (int axis = 0; axis < 3; ++axis) {
+					min[axis] = std::min(min[axis], xyz[axis]);
+					max[axis] = std::max(max[axis], xyz[axis]);
+				}
+			}
+		}
+
+		std::uint64_t divisions[3];
+		for (int axis = 0; axis < 3; ++axis) divisions[axis] = max[axis] < min[axis] ? 1 : std::uint64_t((max[axis] - min[axis]) / leaf) + 1;
+		if (double(divisions[0]) * double(divisions[1]) * double(divisions[2]) > double(std::numeric_limits<std::uint64_t>::max())) {
+			std::string what2 = what.empty() ? std::string() : ": " + what;
+			throw std::runtime_error("Voxel size of " + std::to_string(voxel_size) + " m is too small for the point cloud" + what2 + ".");
+		}
+
+		// Compute the voxel of each valid point and sort the points by voxel.
+		std::vector<std::pair<std::uint64_t, std::uint32_t>> & voxels = voxelBuffer();
+		voxels.clear();
+		for (int row = 0; row < grid.height; ++row) {
+			for (int col = 0; col < grid.width; ++col) {
+				std::size_t i = grid.index(info, row, col);
+				float xyz[3];
+				if (!transform.apply(input + i * 3, xyz)) continue;
+				std::uint64_t x = std::uint64_t((xyz[0] - min[0]) / leaf);
+				std::uint64_t y = std::uint64_t((xyz[1] - min[1]) / leaf);
+				std::uint64_t z = std::uint64_t((xyz[2] - min[2]) / leaf);
+				voxels.emplace_back(x + divisions[0] * (y + divisions[1] * z), std::uint32_t(i));
+			}
+		}
+		std::sort(voxels.begin(), voxels.end());
+		valid = voxels.size();
+
+		std::size_t count = 0;
+		for (std::size_t i = 0; i < voxels.size(); ++i) {
+			if (i == 0 || voxels[i].first != voxels[i - 1].first) ++count;
+		}
+
+		Point * points = storage.resize(count);
+		if (indices) indices->resize(count);
+
+		// Average each run of points in the same voxel.
+		std::size_t output = 0;
+		for (std::size_t begin = 0; begin < voxels.size();) {
+			std::size_t end = begin;
+			double xyz[3]   = {0, 0, 0};
+			double color[3] = {0, 0, 0};
+			for (; end < voxels.size() && voxels[end].first == voxels[begin].first; ++end) {
+				std::size_t i = voxels[end].second;
+				float point[3];
+				transform.apply(input + i * 3, point);
+				for (int axis = 0; axis < 3; ++axis) xyz[axis] += point[axis];
+				std::uint8_t const * pixel = texturePixel(texture, i / info.width, i % info.width);
+				if (pixel) for (int channel = 0; channel < texture.channels(); ++channel) color[channel] += pixel[channel];
+			}
+
+			double n = end - begin;
+			float centroid[3];
+			std::uint8_t pixel[3];
+			for (int axis = 0; axis < 3; ++axis) centroid[axis] = xyz[axis] / n;
+			for (int channel = 0; channel < 3; ++channel) pixel[channel] = std::uint8_t(color[channel] / n + 0.5);
+
+			points[output] = makePoint<Point>(centroid, texture.empty() ? nullptr : pixel, texture.channels());
+			if (indices) (*indices)[output] = voxels[begin].second;
+			++output;
+			begin = end;
+		}
+
+		return count;
+	}
+
+	/// Point storage backed by a PCL point cloud.
+	template<typename Point>
+	struct CloudStorage {
+		pcl::PointCloud<Point> & cloud;
+
+		Point * resize(std::size_t size) {
+			cloud.points.resize(size);
+			return cloud.points.data();
+		}
+	};
+
+	/// Point storage backed by the data of a PointCloud2 message, using the memory layout of the PCL point type.
+	template<typename Point>
+	struct MessageStorage {
+		sensor_msgs::PointCloud2 & message;
+
+		Point * resize(std::size_t size) {
+			message.data.resize(size * sizeof(Point));
+			if (reinterpret_cast<std::uintptr_t>(message.data.data()) % alignof(Point)) throw std::runtime_error("PointCloud2 data is not aligned for direct conversion.");
+			return reinterpret_cast<Point *>(message.data.data());
+		}
+	};
+
+	/// Shape of a converted point cloud.
+	struct CloudLayout {
+		std::uint32_t width;
+		std::uint32_t height;
+		bool is_dense;
+	};
+
+	/// Convert a point map into point storage.
+	template<typename Point, typename Storage>
+	CloudLayout convertInto(
+		Storage & storage,
+		PointMapInfo const & info,
+		NxLibItem const & item,
+		cv::Mat const & texture,
+		PointCloudOptions const & options,
+		std::vector<int> * indices,
+		std::string const & what
+	) {
+		static_assert(sizeof(Point) >= 3 * sizeof(float), "point type too small to hold the packed point map");
+		checkTexture(texture, info, what);
+
+		if (options.decimation < 1) {
+			std::string what2 = what.empty() ? std::string() : ": " + what;
+			throw std::runtime_error("Invalid decimation factor: " + std::to_string(options.decimation) + ", expected at least 1" + what2 + ".");
+		}
+
+		ThreadPool & pool = threadPool(options);
+		PointMapTransform transform = makeTransform(options);
+		SampleGrid grid(info, options.decimation);
+		PointCloudStatistics statistics;
+		statistics.sampled = grid.size();
+		CloudLayout layout{std::uint32_t(grid.width), std::uint32_t(grid.height), false};
+
+		// The packed input data if it is still intact after conversion, otherwise the points converted in place.
+		float const * staged = nullptr;
+		Point const * in_place = nullptr;
+
+		if (options.dense || options.decimation > 1 || options.voxel_size > 0) {
+			// These conversions produce fewer points than the point map holds, so retrieve the data in a staging buffer.
+			std::vector<float> & buffer = stagingBuffer();
+			buffer.resize(info.size() * 3);
+			retrievePointMap(item, info, buffer.data(), what);
+			staged = buffer.data();
+
+			if (options.voxel_size > 0) {
+				std::size_t voxels = voxelizePointMap<Point>(buffer.data(), storage, info, grid, transform, texture, options.voxel_size, indices, statistics.valid, what);
+				layout = CloudLayout{std::uint32_t(voxels), 1, true};
+			} else if (options.dense) {
+				statistics.valid = compactPointMap<Point>(buffer.data(), storage, info, grid, transform, texture, pool, indices);
+				layout = CloudLayout{std::uint32_t(statistics.valid), 1, true};
+			} else {
+				statistics.valid = decimatePointMap<Point>(buffer.data(), storage, info, grid, transform, texture, pool, indices);
+			}
+		} else {
+			Point * points = storage.resize(info.size());
+			if (indices) indices->clear();
+
+			std::size_t chunks = chunkCount(pool, info.height);
+			if (chunks == 1) {
+				// Retrieve the packed XYZ data directly into the point storage.
+				// Every point occupies more space than the three floats we receive for it, so the data fits.
+				float * data = retrievePointMap(item, info, points, what);
+
+				// Spread the packed data over the points (and convert milimeters in meters, then transform and crop them).
+				statistics.valid = convertTextured(data, points, info, transform, texture, 0, info.height);
+				in_place = points;
+			} else {
+				// Converting chunks in place would overwrite the input of the next chunk, so use the staging buffer.
+				std::vector<float> & buffer = stagingBuffer();
+				buffer.resize(info.size() * 3);
+				retrievePointMap(item, info, buffer.data(), what);
+				staged = buffer.data();
+
+				std::vector<std::size_t> valid(chunks, 0);
+				pool.parallelFor(chunks, [&] (std::size_t chunk) {
+					valid[chunk] = convertTextured(buffer.data(), points, info, transform, texture, chunkBegin(info.height, chunks, chunk), chunkBegin(info.height, chunks, chunk + 1));
+				});
+				for (std::size_t count : valid) statistics.valid += count;
+			}
+		}
+
+		statistics.points = std::size_t(layout.width) * layout.height;
+		if (options.statistics) {
+			if (staged) {
+				statistics.region = validRegion(grid, pool, [&] (int row, int col) { return staged[grid.index(info, row, col) * 3 + 2]; });
+			} else {
+				statistics.region = validRegion(grid, pool, [&] (int row, int col) { return in_place[std::size_t(row) * info.width + col].z; });
+			}
+			*options.statistics = statistics;
+		}
+		return layout;
+	}
+
+	/// Number of bytes per point in compact point clouds.
+	constexpr std::uint32_t compact_point_step = 3 * sizeof(std::int16_t);
+
+	/// Get the point cloud of the calling thread used as intermediate for compact point clouds.
+	pcl::PointCloud<pcl::PointXYZ> & compactBuffer() {
+		static thread_local pcl::PointCloud<pcl::PointXYZ> buffer;
+		return buffer;
+	}
+
+	/// Quantize a coordinate in meters to millimeters, or return false if it can not be represented.
+	bool quantize(float meters, std::int16_t & millimeters) {
+		float value = std::round(meters * 1000.0f);
+		if (!(value > compactInvalid && value <= std::numeric_limits<std::int16_t>::max())) return false;
+		millimeters = std::int16_t(value);
+		return true;
+	}
+
+	/// Make a PointCloud2 field.
+	sensor_msgs::PointField makeField(std::string const & name, std::uint32_t offset, std::uint8_t datatype) {
+		sensor_msgs::PointField field;
+		field.name     = name;
+		field.offset   = offset;
+		field.datatype = datatype;
+		field.count    = 1;
+		return field;
+	}
 }
 
-pcl::PointCloud<pcl::PointXYZ> toPointCloud(NxLibItem const & item, std::string const & what) {
-	int error = 0;
-
-	// Retrieve metadata.
-	int height, width, channels, element_width;
-	bool is_float;
-	double timestamp;
-	item.getBinaryDataInfo(&error, &width, &height, &channels, &element_width, &is_float, &timestamp);
-	if (error) throw NxError(item, error, what);
-
-	// Make sure data is what we expect.
-	std::string what2 = what.empty() ? std::string() : ": " + what;
-	if (channels != 3) throw std::runtime_error("Unexpected number of channels: " + std::to_string(channels) + ", expected 3" + what2 + ".");
-	if (!is_float) throw std::runtime_error("Expected floating point data for point cloud conversion" + what2 + ".");
-	if (element_width != 4) throw std::runtime_error("Unexpected data width: " + std::to_string(element_width) + ", expected 4" + what2 + ".");
-
-	// Retrieve data.
-	std::vector<float> point_list;
-	item.getBinaryData(&error, point_list, 0);
-	if (error) throw NxError(item, error, what);
-
-	// Copy point cloud and convert in meters
-	pcl::PointCloud<pcl::PointXYZ> cloud;
-	cloud.header.stamp    = ensensoStampToPcl(timestamp);
+template<typename Point>
+void toPointCloud(
+	pcl::PointCloud<Point> & cloud,
+	NxLibItem const & item,
+	cv::Mat const & texture,
+	PointCloudOptions const & options,
+	std::vector<int> * indices,
+	std::string const & what
+) {
+	PointMapInfo info = getPointMapInfo(item, what);
+	CloudStorage<Point> storage{cloud};
+	CloudLayout layout = convertInto<Point>(storage, info, item, texture, options, indices, what);
+
+	cloud.header.stamp    = ensensoStampToPcl(info.timestamp);
+	cloud.header.frame_id = "/camera_link";
+	cloud.width           = layout.width;
+	cloud.height          = layout.height;
+	cloud.is_dense        = layout.is_dense;
+}
+
+template<typename Point>
+void toPointCloud(pcl::PointCloud<Point> & cloud, NxLibItem const & item, cv::Mat const & texture, std::string const & what) {
+	toPointCloud(cloud, item, texture, PointCloudOptions(), nullptr, what);
+}
+
+void toPointCloud(pcl::PointCloud<pcl::PointXYZ> & cloud, NxLibItem const & item, std::string const & what) {
+	toPointCloud(cloud, item, cv::Mat(), what);
+}
+
+template<typename Point>
+void toPointCloud2(
+	sensor_msgs::PointCloud2 & cloud,
+	NxLibItem const & item,
+	cv::Mat const & texture,
+	PointCloudOptions const & options,
+	std::vector<int> * indices,
+	std::string const & what
+) {
+	PointMapInfo info = getPointMapInfo(item, what);
+	MessageStorage<Point> storage{cloud};
+	CloudLayout layout = convertInto<Point>(storage, info, item, texture, options, indices, what);
+
+	// Use the same fields as pcl::toROSMsg would for this point type.
+	std::vector<pcl::PCLPointField> fields;
+	pcl::for_each_type<typename pcl::traits::fieldList<Point>::type>(pcl::detail::FieldAdder<Point>(fields));
+	pcl_conversions::fromPCL(fields, cloud.fields);
+
+	pcl_conversions::fromPCL(ensensoStampToPcl(info.timestamp), cloud.header.stamp);
 	cloud.header.frame_id = "/camera_link";
-	cloud.width           = width;
-	cloud.height          = height;
-	cloud.is_dense        = false;
-	cloud.resize(height * width);
+	cloud.width           = layout.width;
+	cloud.height          = layout.height;
+	cloud.is_bigendian    = false;
+	cloud.point_step      = sizeof(Point);
+	cloud.row_step        = layout.width * sizeof(Point);
+	cloud.is_dense        = layout.is_dense;
+}
 
-	// Copy data in point cloud (and convert milimeters in meters)
-	for (size_t i = 0; i < point_list.size (); i += 3) {
-		cloud.points[i / 3].x = point_list[i] / 1000.0;
-		cloud.points[i / 3].y = point_list[i + 1] / 1000.0;
-		cloud.points[i / 3].z = point_list[i + 2] / 1000.0;
+
+void toCompactPointCloud2(
+	sensor_msgs::PointCloud2 & cloud,
+	NxLibItem const & item,
+	PointCloudOptions const & options,
+	std::vector<int> * indices,
+	std::string const & what
+) {
+	// Convert with the regular code path so all options are supported, then quantize.
+	pcl::PointCloud<pcl::PointXYZ> & points = compactBuffer();
+	toPointCloud(points, item, cv::Mat(), options, indices, what);
+
+	cloud.data.resize(points.size() * compact_point_step);
+	std::uint8_t * output = cloud.data.data();
+	for (pcl::PointXYZ const & point : points.points) {
+		std::int16_t xyz[3];
+		if (!quantize(point.x, xyz[0]) || !quantize(point.y, xyz[1]) || !quantize(point.z, xyz[2])) {
+			xyz[0] = xyz[1] = xyz[2] = compactInvalid;
+		}
+		std::memcpy(output, xyz, compact_point_step);
+		output += compact_point_step;
 	}
 
+	cloud.fields.resize(3);
+	cloud.fields[0] = makeField("x", 0 * sizeof(std::int16_t), sensor_msgs::PointField::INT16);
+	cloud.fields[1] = makeField("y", 1 * sizeof(std::int16_t), sensor_msgs::PointField::INT16);
+	cloud.fields[2] = makeField("z", 2 * sizeof(std::int16_t), sensor_msgs::PointField::INT16);
+
+	pcl_conversions::fromPCL(points.header.stamp, cloud.header.stamp);
+	cloud.header.frame_id = points.header.frame_id;
+	cloud.width           = points.width;
+	cloud.height          = points.height;
+	cloud.is_bigendian    = false;
+	cloud.point_step      = compact_point_step;
+	cloud.row_step        = points.width * compact_point_step;
+	cloud.is_dense        = points.is_dense;
+}
+
+bool isCompactPointCloud2(sensor_msgs::PointCloud2 const & cloud) {
+	if (cloud.point_step != compact_point_step || cloud.is_bigendian || cloud.fields.size() != 3) return false;
+	if (cloud.row_step < std::size_t(cloud.width) * compact_point_step) return false;
+	char const * names[] = {"x", "y", "z"};
+	for (std::size_t i = 0; i < 3; ++i) {
+		sensor_msgs::PointField const & field = cloud.fields[i];
+		if (field.name != names[i] || field.offset != i * sizeof(std::int16_t) || field.datatype != sensor_msgs::PointField::INT16 || field.count != 1) return false;
+	}
+	return true;
+}
+
+void fromCompactPointCloud2(pcl::PointCloud<pcl::PointXYZ> & cloud, sensor_msgs::PointCloud2 const & message) {
+	if (!isCompactPointCloud2(message)) throw std::runtime_error("PointCloud2 message does not use the compact point cloud encoding.");
+	std::size_t size = std::size_t(message.width) * message.height;
+
+	// Rows are read at row_step, which may include padding, so the last row only needs to hold its points.
+	std::size_t row_size = std::size_t(message.width) * compact_point_step;
+	if (message.row_step < row_size) throw std::runtime_error("PointCloud2 message has a row step smaller than its rows.");
+	if (message.height > 0 && message.data.size() < (message.height - 1) * std::size_t(message.row_step) + row_size) {
+		throw std::runtime_error("PointCloud2 message holds less data than its size indicates.");
+	}
+
+	cloud.points.resize(size);
+	for (std::size_t i = 0; i < size; ++i) {
+		std::uint8_t const * input = message.data.data() + (i / message.width) * message.row_step + (i % message.width) * compact_point_step;
+		std::int16_t xyz[3];
+		std::memcpy(xyz, input, compact_point_step);
+		pcl::PointXYZ & point = cloud.points[i];
+		if (xyz[0] == compactInvalid && xyz[1] == compactInvalid && xyz[2] == compactInvalid) {
+			point.x = point.y = point.z = std::numeric_limits<float>::quiet_NaN();
+		} else {
+			point.x = xyz[0] / 1000.0f;
+			point.y = xyz[1] / 1000.0f;
+			point.z = xyz[2] / 1000.0f;
+		}
+	}
+
+	pcl_conversions::toPCL(message.header, cloud.header);
+	cloud.width    = message.width;
+	cloud.height   = message.height;
+	cloud.is_dense = message.is_dense;
+}
+
+pcl::PointCloud<pcl::PointXYZ> toPointCloud(NxLibItem const & item, std::string const & what) {
+	pcl::PointCloud<pcl::PointXYZ> cloud;
+	toPointCloud(cloud, item, what);
 	return cloud;
 }
 
+template void toPointCloud<pcl::PointXYZ>(pcl::PointCloud<pcl::PointXYZ> & cloud, NxLibItem const & item, cv::Mat const & texture, std::string const & what);
+template void toPointCloud<pcl::PointXYZI>(pcl::PointCloud<pcl::PointXYZI> & cloud, NxLibItem const & item, cv::Mat const & texture, std::string const & what);
+template void toPointCloud<pcl::PointXYZRGB>(pcl::PointCloud<pcl::PointXYZRGB> & cloud, NxLibItem const & item, cv::Mat const & texture, std::string const & what);
+
+template void toPointCloud<pcl::PointXYZ>(pcl::PointCloud<pcl::PointXYZ> & cloud, NxLibItem const & item, cv::Mat const & texture, PointCloudOptions const & options, std::vector<int> * indices, std::string const & what);
+template void toPointCloud<pcl::PointXYZI>(pcl::PointCloud<pcl::PointXYZI> & cloud, NxLibItem const & item, cv::Mat const & texture, PointCloudOptions const & options, std::vector<int> * indices, std::string const & what);
+template void toPointCloud<pcl::PointXYZRGB>(pcl::PointCloud<pcl::PointXYZRGB> & cloud, NxLibItem const & item, cv::Mat const & texture, PointCloudOptions const & options, std::vector<int> * indices, std::string const & what);
+template void toPointCloud2<pcl::PointXYZ>(sensor_msgs::PointCloud2 & cloud, NxLibItem const & item, cv::Mat const & texture, PointCloudOptions const & options, std::vector<int> * indices, std::string const & what);
+template void toPointCloud2<pcl::PointXYZI>(sensor_msgs::PointCloud2 & cloud, NxLibItem const & item, cv::Mat const & texture, PointCloudOptions const & options, std::vector<int> * indices, std::string const & what);
+template void toPointCloud2<pcl::PointXYZRGB>(sensor_msgs::PointCloud2 & cloud, NxLibItem const & item, cv::Mat const & texture, PointCloudOptions const & options, std::vector<int> * indices, std::string const & what);
+
 }
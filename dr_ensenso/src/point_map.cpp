@@ -0,0 +1,199 @@
+#include "point_map.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DR_ENSENSO_X86_DISPATCH
+#include <emmintrin.h>
+#endif
+
+namespace dr {
+
+namespace {
+	using Kernel          = std::size_t (*)(float const * input, pcl::PointXYZ * output, std::size_t count, float divisor);
+	using TransformKernel = std::size_t (*)(float const * input, pcl::PointXYZ * output, std::size_t count, PointMapTransform const & transform);
+
+	/// Convert the points in the range [start, end) one at a time, back to front.
+	std::size_t convertScalar(float const * input, pcl::PointXYZ * output, std::size_t start, std::size_t end, float divisor) {
+		std::size_t valid = 0;
+		for (std::size_t i = end; i-- > start;) {
+			float x = input[i * 3];
+			float y = input[i * 3 + 1];
+			float z = input[i * 3 + 2];
+			output[i].x       = x / divisor;
+			output[i].y       = y / divisor;
+			output[i].z       = z / divisor;
+			output[i].data[3] = 1.0f;
+			valid += z == z;
+		}
+		return valid;
+	}
+
+	std::size_t convertScalar(float const * input, pcl::PointXYZ * output, std::size_t count, float divisor) {
+		return convertScalar(input, output, 0, count, divisor);
+	}
+
+	/// Convert and transform points one at a time, back to front.
+	std::size_t transformScalar(float const * input, pcl::PointXYZ * output, std::size_t count, PointMapTransform const & transform) {
+		std::size_t valid = 0;
+		for (std::size_t i = count; i-- > 0;) {
+			float xyz[3];
+			valid += transform.apply(input + i * 3, xyz);
+			output[i].x       = xyz[0];
+			output[i].y       = xyz[1];
+			output[i].z       = xyz[2];
+			output[i].data[3] = 1.0f;
+		}
+		return valid;
+	}
+
+#ifdef DR_ENSENSO_X86_DISPATCH
+	/// Convert blocks of 4 points with SSE2.
+	__attribute__((target("sse2")))
+	std::size_t convertSse2(float const * input, pcl::PointXYZ * output, std::size_t count, float divisor) {
+		std::size_t blocks = count / 4;
+		std::size_t valid  = convertScalar(input, output, blocks * 4, count, divisor);
+
+		float * out = reinterpret_cast<float *>(output);
+		__m128 const factor = _mm_set1_ps(divisor);
+		__m128 const mask   = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+		__m128 const one    = _mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f);
+
+		for (std::size_t block = blocks; block-- > 0;) {
+			// Load the whole block before writing anything, in case we're converting in place.
+			float const * in = input + block * 12;
+			__m128 v0 = _mm_loadu_ps(in);     // x0 y0 z0 x1
+			__m128 v1 = _mm_loadu_ps(in + 4); // y1 z1 x2 y2
+			__m128 v2 = _mm_loadu_ps(in + 8); // z2 x3 y3 z3
+
+			__m128 t  = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1, 0, 3, 3)); // x1 x1 y1 z1
+			__m128 p0 = v0;
+			__m128 p1 = _mm_shuffle_ps(t,  t,  _MM_SHUFFLE(3, 3, 2, 0));
+			__m128 p2 = _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(0, 0, 3, 2));
+			__m128 p3 = _mm_shuffle_ps(v2, v2, _MM_SHUFFLE(3, 3, 2, 1));
+
+			// Count the points with an ordered (not NaN) z coordinate: z0 is lane 2 of v0, z1 lane 1 of v1, z2 and z3 lanes 0 and 3 of v2.
+			int ordered0 = _mm_movemask_ps(_mm_cmpord_ps(v0, v0));
+			int ordered1 = _mm_movemask_ps(_mm_cmpord_ps(v1, v1));
+			int ordered2 = _mm_movemask_ps(_mm_cmpord_ps(v2, v2));
+			valid += ((ordered0 >> 2) & 1) + ((ordered1 >> 1) & 1) + (ordered2 & 1) + ((ordered2 >> 3) & 1);
+
+			// Scale and replace the last lane with the padding value.
+			float * target = out + block * 16;
+			_mm_storeu_ps(target,      _mm_or_ps(_mm_and_ps(_mm_div_ps(p0, factor), mask), one));
+			_mm_storeu_ps(target + 4,  _mm_or_ps(_mm_and_ps(_mm_div_ps(p1, factor), mask), one));
+			_mm_storeu_ps(target + 8,  _mm_or_ps(_mm_and_ps(_mm_div_ps(p2, factor), mask), one));
+			_mm_storeu_ps(target + 12, _mm_or_ps(_mm_and_ps(_mm_div_ps(p3, factor), mask), one));
+		}
+		return valid;
+	}
+
+	/// Convert and transform blocks of 4 points with SSE2.
+	/**
+	 * The packed points are split in vectors of x, y and z coordinates, so all lanes do useful work.
+	 * The terms are added in the same order as PointMapTransform::apply, so the results are identical.
+	 * Invalid and cropped points are blended in without branching, since they are often scattered over the point map.
+	 */
+	template<bool transformed, bool cropped>
+	__attribute__((target("sse2")))
+	std::size_t transformSse2(float const * input, pcl::PointXYZ * output, std::size_t count, PointMapTransform const & transform) {
+		std::size_t blocks = count / 4;
+		std::size_t valid  = transformScalar(input + blocks * 12, output + blocks * 4, count - blocks * 4, transform);
+
+		float const * m = transform.matrix;
+		float const * b = transform.crop_matrix;
+		__m128 const divisor = _mm_set1_ps(transform.divisor);
+		__m128 const one     = _mm_set1_ps(1.0f);
+		__m128 const nan     = _mm_set1_ps(NAN);
+
+		for (std::size_t block = blocks; block-- > 0;) {
+			// Load the whole block before writing anything, in case we're converting in place.
+			float const * in = input + block * 12;
+			__m128 v0 = _mm_loadu_ps(in);     // x0 y0 z0 x1
+			__m128 v1 = _mm_loadu_ps(in + 4); // y1 z1 x2 y2
+			__m128 v2 = _mm_loadu_ps(in + 8); // z2 x3 y3 z3
+
+			__m128 x = _mm_shuffle_ps(_mm_shuffle_ps(v0, v0, _MM_SHUFFLE(3, 3, 3, 0)), _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 1, 0));
+			__m128 y = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 z = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(v2, v2, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 mask = _mm_cmpord_ps(z, z);
+
+			x = _mm_div_ps(x, divisor);
+			y = _mm_div_ps(y, divisor);
+			z = _mm_div_ps(z, divisor);
+
+			if (transformed) {
+				__m128 tx = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0]), x), _mm_mul_ps(_mm_set1_ps(m[1]), y)), _mm_mul_ps(_mm_set1_ps(m[2]),  z)), _mm_set1_ps(m[3]));
+				__m128 ty = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[4]), x), _mm_mul_ps(_mm_set1_ps(m[5]), y)), _mm_mul_ps(_mm_set1_ps(m[6]),  z)), _mm_set1_ps(m[7]));
+				__m128 tz = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[8]), x), _mm_mul_ps(_mm_set1_ps(m[9]), y)), _mm_mul_ps(_mm_set1_ps(m[10]), z)), _mm_set1_ps(m[11]));
+				x = tx;
+				y = ty;
+				z = tz;
+			}
+
+			if (cropped) {
+				for (int axis = 0; axis < 3; ++axis) {
+					float const * row = b + axis * 4;
+					__m128 q = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(row[0]), x), _mm_mul_ps(_mm_set1_ps(row[1]), y)), _mm_mul_ps(_mm_set1_ps(row[2]), z)), _mm_set1_ps(row[3]));
+					mask = _mm_and_ps(mask, _mm_cmpge_ps(q, _mm_set1_ps(transform.crop_min[axis])));
+					mask = _mm_and_ps(mask, _mm_cmple_ps(q, _mm_set1_ps(transform.crop_max[axis])));
+				}
+			}
+
+			x = _mm_or_ps(_mm_and_ps(mask, x), _mm_andnot_ps(mask, nan));
+			y = _mm_or_ps(_mm_and_ps(mask, y), _mm_andnot_ps(mask, nan));
+			z = _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, nan));
+			__m128 padding = one;
+
+			// Interleave the coordinates back into points.
+			_MM_TRANSPOSE4_PS(x, y, z, padding);
+			float * target = reinterpret_cast<float *>(output + block * 4);
+			_mm_storeu_ps(target,      x);
+			_mm_storeu_ps(target + 4,  y);
+			_mm_storeu_ps(target + 8,  z);
+			_mm_storeu_ps(target + 12, padding);
+
+			int bits = _mm_movemask_ps(mask);
+			valid += (bits & 1) + ((bits >> 1) & 1) + ((bits >> 2) & 1) + ((bits >> 3) & 1);
+		}
+		return valid;
+	}
+
+	/// Convert and transform points with SSE2, with only the needed steps compiled in.
+	__attribute__((target("sse2")))
+	std::size_t transformSse2(float const * input, pcl::PointXYZ * output, std::size_t count, PointMapTransform const & transform) {
+		if (transform.transformed && transform.cropped) return transformSse2<true, true>(input, output, count, transform);
+		if (transform.transformed) return transformSse2<true, false>(input, output, count, transform);
+		if (transform.cropped) return transformSse2<false, true>(input, output, count, transform);
+		return transformSse2<false, false>(input, output, count, transform);
+	}
+#endif
+
+	/// Select the fastest kernel supported by the CPU.
+	Kernel selectKernel() {
+#ifdef DR_ENSENSO_X86_DISPATCH
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse2")) return convertSse2;
+#endif
+		return convertScalar;
+	}
+
+	/// Select the fastest transforming kernel supported by the CPU.
+	TransformKernel selectTransformKernel() {
+#ifdef DR_ENSENSO_X86_DISPATCH
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse2")) return transformSse2;
+#endif
+		return transformScalar;
+	}
+}
+
+std::size_t convertPointMap(float const * input, pcl::PointXYZ * output, std::size_t count, float divisor) {
+	static Kernel const kernel = selectKernel();
+	return kernel(input, output, count, divisor);
+}
+
+std::size_t convertPointMap(float const * input, pcl::PointXYZ * output, std::size_t count, PointMapTransform const & transform) {
+	static TransformKernel const kernel = selectTransformKernel();
+	return kernel(input, output, count, transform);
+}
+
+}
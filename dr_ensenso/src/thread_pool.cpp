@@ -0,0 +1,98 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+namespace dr {
+
+ThreadPool::ThreadPool(std::size_t threads) {
+	if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+	workers.reserve(threads - 1);
+	for (std::size_t i = 1; i < threads; ++i) workers.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	start_condition.notify_all();
+	for (std::thread & worker : workers) worker.join();
+}
+
+void ThreadPool::parallelFor(std::size_t count, std::function<void (std::size_t)> const & function) {
+	// Don't bother waking the workers if there is nothing to share.
+	if (workers.empty() || count <= 1) {
+		for (std::size_t chunk = 0; chunk < count; ++chunk) function(chunk);
+		return;
+	}
+
+	std::lock_guard<std::mutex> dispatch(dispatch_mutex);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job        = &function;
+		job_count  = count;
+		next_chunk = 0;
+		error      = nullptr;
+		++generation;
+	}
+	start_condition.notify_all();
+
+	runChunks(function, count);
+
+	// Wait for the workers to leave the job too, so none of them can take a chunk of the next job.
+	std::exception_ptr result;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		done_condition.wait(lock, [this] () { return active == 0; });
+		job = nullptr;
+		std::swap(result, error);
+	}
+	if (result) std::rethrow_exception(result);
+}
+
+void ThreadPool::work() {
+	std::uint64_t seen = 0;
+	while (true) {
+		std::function<void (std::size_t)> const * function;
+		std::size_t count;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			start_condition.wait(lock, [&] () { return stop || (job && generation != seen); });
+			if (stop) return;
+			seen     = generation;
+			function = job;
+			count    = job_count;
+			++active;
+		}
+
+		runChunks(*function, count);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--active == 0) done_condition.notify_all();
+	}
+}
+
+void ThreadPool::runChunks(std::function<void (std::size_t)> const & function, std::size_t count) {
+	while (true) {
+		std::size_t chunk;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (next_chunk >= count) return;
+			chunk = next_chunk++;
+		}
+
+		try {
+			function(chunk);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!error) error = std::current_exception();
+		}
+	}
+}
+
+ThreadPool & defaultThreadPool() {
+	static ThreadPool pool;
+	return pool;
+}
+
+}
@@ -1,10 +1,43 @@
 #include "util.hpp"
 
+#include <atomic>
 #include <fstream>
+#include <mutex>
 #include <sstream>
 
 namespace dr {
 
+namespace {
+	/// The number of NxLib tree accesses made by this library.
+	std::atomic<std::uint64_t> tree_accesses{0};
+
+	/// Protects the NxLib reference count.
+	std::mutex nxlib_mutex;
+
+	/// The number of users that initialized the NxLib.
+	std::size_t nxlib_users = 0;
+}
+
+void initializeNxLib() {
+	std::lock_guard<std::mutex> lock(nxlib_mutex);
+	if (nxlib_users == 0) nxLibInitialize();
+	++nxlib_users;
+}
+
+void finalizeNxLib() {
+	std::lock_guard<std::mutex> lock(nxlib_mutex);
+	if (nxlib_users == 0) return;
+	if (--nxlib_users == 0) nxLibFinalize();
+}
+
+std::uint64_t nxTreeAccesses() {
+	return tree_accesses.load(std::memory_order_relaxed);
+}
+
+void countNxTreeAccess(std::uint64_t count) {
+	tree_accesses.fetch_add(count, std::memory_order_relaxed);
+}
+
 boost::optional<NxLibItem> findCameraBySerial(std::string const & serial) {
 	NxLibItem camera = NxLibItem{}[itmCameras][itmBySerialNo][serial];
 	if (!camera.exists()) return {};
@@ -64,13 +97,31 @@ boost::optional<NxLibItem> openCameraByType(std::string const & type) {
 
 void executeNx(NxLibCommand const & command, std::string const & what) {
 	int error = 0;
+	countNxTreeAccess();
 	command.execute(&error);
 	if (error) throwCommandError(error, what);
 }
 
+void PreparedNxCommand::prepare(std::uint64_t key, std::function<void (NxLibItem const & parameters)> const & write) {
+	if (prepared && this->key == key) return;
+
+	NxLibItem parameters = command.parameters();
+	prepared = false;
+	countNxTreeAccess();
+	if (parameters.exists()) {
+		countNxTreeAccess();
+		parameters.erase();
+	}
+
+	write(parameters);
+	this->key = key;
+	prepared  = true;
+}
+
 std::int64_t getNxBinaryTimestamp(NxLibItem const & item, std::string const & what) {
 	int error = 0;
 	double timestamp = 0;
+	countNxTreeAccess();
 	item.getBinaryDataInfo(&error, nullptr, nullptr, nullptr, nullptr, nullptr, &timestamp);
 	if (error) throw NxError(item, error, what);
 	return (timestamp - 11644473600.0) * 1e6; // Correct for epoch and turn into microseconds.
@@ -78,6 +129,7 @@ std::int64_t getNxBinaryTimestamp(NxLibItem const & item, std::string const & wh
 
 void setNxJson(NxLibItem const & item, std::string const & json, std::string const & what) {
 	int error = 0;
+	countNxTreeAccess();
 	item.setJson(&error, json, true);
 	if (error) throw NxError(item, error, what);
 }
@@ -100,6 +152,7 @@ bool setNxJsonFromFile(NxLibItem const & item, std::string const & filename, std
 
 std::string getNxJson(NxLibItem const & item, std::string const & what) {
 	int error = 0;
+	countNxTreeAccess();
 	std::string result = item.asJson(&error, true);
 	if (error) throw NxError(item, error, what);
 	return result;
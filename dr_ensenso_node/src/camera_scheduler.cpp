@@ -0,0 +1,35 @@
+#include "camera_scheduler.hpp"
+
+namespace dr {
+
+CameraScheduler::Access CameraScheduler::request() {
+	std::unique_lock<std::mutex> lock(mutex);
+	++waiting;
+
+	// Previews are not worth waiting for, so ask the running preview to stop early.
+	if (holder == Holder::preview && preempt) preempt();
+
+	condition.wait(lock, [this] () { return holder == Holder::none; });
+	--waiting;
+	holder = Holder::request;
+	if (resume) resume();
+	return Access(this);
+}
+
+CameraScheduler::Access CameraScheduler::preview() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (holder != Holder::none || waiting) return Access();
+	holder = Holder::preview;
+	if (resume) resume();
+	return Access(this);
+}
+
+void CameraScheduler::release() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		holder = Holder::none;
+	}
+	condition.notify_all();
+}
+
+}
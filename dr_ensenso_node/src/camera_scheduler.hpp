@@ -0,0 +1,97 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+namespace dr {
+
+/// Schedules exclusive access to the camera, giving service requests priority over previews.
+/**
+ * Requests wait until the camera is free, and go before any preview.
+ * Previews never wait: they are skipped when the camera is in use or a request is waiting.
+ */
+class CameraScheduler {
+	/// The kind of user that holds the camera.
+	enum class Holder {
+		none,
+		request,
+		preview,
+	};
+
+public:
+	/// Exclusive access to the camera, released when destroyed.
+	class Access {
+		/// The scheduler that granted the access, or null if access was not granted.
+		CameraScheduler * scheduler;
+
+	public:
+		explicit Access(CameraScheduler * scheduler = nullptr) : scheduler(scheduler) {}
+
+		Access(Access && other) : scheduler(other.scheduler) {
+			other.scheduler = nullptr;
+		}
+
+		Access(Access const &) = delete;
+		Access & operator=(Access const &) = delete;
+
+		~Access() {
+			if (scheduler) scheduler->release();
+		}
+
+		/// Check if access was granted.
+		explicit operator bool() const {
+			return scheduler != nullptr;
+		}
+	};
+
+	/// Construct a scheduler.
+	/**
+	 * Both callbacks are called with the scheduler locked, so they must be quick and must not use the scheduler.
+	 * A preemption can then not slip in between granting access and resuming.
+	 *
+	 * \param preempt Called when a request has to wait for a preview, to cut the preview short. May be empty.
+	 * \param resume Called whenever access is granted, to undo an earlier preemption. May be empty.
+	 */
+	explicit CameraScheduler(std::function<void()> preempt = nullptr, std::function<void()> resume = nullptr) :
+		preempt(std::move(preempt)),
+		resume(std::move(resume)) {}
+
+	CameraScheduler(CameraScheduler const &) = delete;
+	CameraScheduler & operator=(CameraScheduler const &) = delete;
+
+	/// Wait for access to the camera for a service request.
+	Access request();
+
+	/// Get access to the camera for a preview without waiting.
+	/**
+	 * \return Access that converts to false if the camera is in use or a request is waiting.
+	 */
+	Access preview();
+
+private:
+	/// Release the access to the camera.
+	void release();
+
+	/// Mutex protecting the scheduler state.
+	std::mutex mutex;
+
+	/// Condition signalled when the camera is released.
+	std::condition_variable condition;
+
+	/// The current user of the camera.
+	Holder holder = Holder::none;
+
+	/// The number of requests waiting for the camera.
+	std::size_t waiting = 0;
+
+	/// Called when a request has to wait for a preview.
+	std::function<void()> preempt;
+
+	/// Called when access is granted.
+	std::function<void()> resume;
+};
+
+}
@@ -0,0 +1,139 @@
+#include "dump_writer.hpp"
+#include "timestamp.hpp"
+
+#include <pcl_conversions/pcl_conversions.h>
+#include <pcl/io/pcd_io.h>
+#include <ros/console.h>
+
+#include <opencv2/highgui/highgui.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include <stdexcept>
+#include <utility>
+
+namespace dr {
+
+DumpWriter::DumpWriter(DumpWriterOptions const & options) :
+	options(options),
+	thread(&DumpWriter::run, this) {}
+
+DumpWriter::~DumpWriter() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	queued.notify_all();
+	thread.join();
+}
+
+bool DumpWriter::push(sensor_msgs::PointCloud2ConstPtr cloud, cv::Mat const & image) {
+	Dump dump{getTimeString(), std::move(cloud), image, 0};
+	dump.bytes = dump.cloud->data.size() + image.total() * image.elemSize();
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		switch (options.overflow) {
+			case DumpOverflow::drop_newest:
+				if (!fits(dump.bytes)) {
+					++stats.dropped;
+					ROS_WARN_STREAM("Dump queue is full. Dropped new dump " << dump.name << ".");
+					return false;
+				}
+				break;
+			case DumpOverflow::drop_oldest:
+				while (!fits(dump.bytes)) {
+					ROS_WARN_STREAM("Dump queue is full. Dropped old dump " << queue.front().name << ".");
+					stats.queued_bytes -= queue.front().bytes;
+					queue.pop_front();
+					++stats.dropped;
+				}
+				break;
+			case DumpOverflow::block:
+				dequeued.wait(lock, [&] () { return fits(dump.bytes); });
+				break;
+		}
+
+		stats.queued_bytes += dump.bytes;
+		queue.push_back(std::move(dump));
+	}
+
+	queued.notify_one();
+	return true;
+}
+
+DumpStatistics DumpWriter::statistics() {
+	std::lock_guard<std::mutex> lock(mutex);
+	DumpStatistics result = stats;
+	result.queued = queue.size();
+	return result;
+}
+
+bool DumpWriter::fits(std::size_t bytes) const {
+	if (queue.empty()) return true;
+	if (options.max_queued && queue.size() >= options.max_queued) return false;
+	if (options.max_queued_bytes && stats.queued_bytes + bytes > options.max_queued_bytes) return false;
+	return true;
+}
+
+void DumpWriter::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		queued.wait(lock, [this] () { return stopping || !queue.empty(); });
+		if (queue.empty()) return;
+
+		// keep counting the bytes of the dump until it is written, so the byte limit covers all data held in memory
+		Dump dump = std::move(queue.front());
+		queue.pop_front();
+		lock.unlock();
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool success = true;
+		try {
+			write(dump);
+		} catch (std::exception const & e) {
+			ROS_ERROR_STREAM("Failed to write dump " << dump.name << ". " << e.what());
+			success = false;
+		}
+		std::chrono::microseconds elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+		lock.lock();
+		stats.queued_bytes -= dump.bytes;
+		if (success) {
+			++stats.written;
+			stats.written_bytes += dump.bytes;
+			stats.write_time    += elapsed;
+			ROS_DEBUG_STREAM("Wrote dump " << dump.name << " (" << dump.bytes << " bytes) in " << elapsed.count() / 1000 << " ms."
+				<< " Queued " << queue.size() << " dumps (" << stats.queued_bytes << " bytes),"
+				<< " throughput " << stats.throughput() / (1024 * 1024) << " MiB/s."
+			);
+		} else {
+			++stats.failed;
+		}
+		dequeued.notify_all();
+	}
+}
+
+void DumpWriter::write(Dump const & dump) {
+	// create path if it does not exist
+	boost::filesystem::path path(options.directory);
+	if (!boost::filesystem::is_directory(path)) {
+		boost::filesystem::create_directories(path);
+	}
+
+	pcl::PCLPointCloud2 pcl_cloud;
+	pcl_conversions::toPCL(*dump.cloud, pcl_cloud);
+	std::string cloud_file = options.directory + "/" + dump.name + "_cloud.pcd";
+	if (pcl::io::savePCDFile(cloud_file, pcl_cloud, Eigen::Vector4f::Zero(), Eigen::Quaternionf::Identity(), true) < 0) {
+		throw std::runtime_error("Failed to write " + cloud_file + ".");
+	}
+
+	if (!dump.image.empty()) {
+		std::string image_file = options.directory + "/" + dump.name + "_image.png";
+		if (!cv::imwrite(image_file, dump.image)) {
+			throw std::runtime_error("Failed to write " + image_file + ".");
+		}
+	}
+}
+
+}
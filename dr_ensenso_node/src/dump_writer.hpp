@@ -0,0 +1,141 @@
+#pragma once
+
+#include <sensor_msgs/PointCloud2.h>
+#include <opencv2/core/core.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace dr {
+
+/// What to do with new data when the dump queue is full.
+enum class DumpOverflow {
+	drop_newest, ///< Drop the new data.
+	drop_oldest, ///< Drop the oldest queued data to make room.
+	block,       ///< Wait until there is room in the queue.
+};
+
+/// Options for the dump writer.
+struct DumpWriterOptions {
+	/// The directory to write the data to. Created if it does not exist.
+	std::string directory = "camera_data";
+
+	/// The maximum number of queued dumps. Zero means no limit.
+	std::size_t max_queued = 4;
+
+	/// The maximum number of queued bytes, including the dump being written. Zero means no limit. A dump is always accepted into an empty queue.
+	std::size_t max_queued_bytes = 512 * 1024 * 1024;
+
+	/// What to do with new data when the queue is full.
+	DumpOverflow overflow = DumpOverflow::drop_newest;
+};
+
+/// Statistics of a dump writer.
+struct DumpStatistics {
+	/// The number of dumps waiting to be written.
+	std::size_t queued = 0;
+
+	/// The number of bytes of point cloud and image data waiting to be written, including the dump being written.
+	std::size_t queued_bytes = 0;
+
+	/// The number of dumps written.
+	std::uint64_t written = 0;
+
+	/// The number of bytes of point cloud and image data written.
+	std::uint64_t written_bytes = 0;
+
+	/// The number of dumps dropped because the queue was full.
+	std::uint64_t dropped = 0;
+
+	/// The number of dumps that failed to write.
+	std::uint64_t failed = 0;
+
+	/// The total time spent writing.
+	std::chrono::microseconds write_time{0};
+
+	/// The average write throughput in bytes per second, or zero if nothing was written yet.
+	double throughput() const {
+		return write_time.count() ? written_bytes * 1e6 / write_time.count() : 0;
+	}
+};
+
+/// Writes point clouds and images to disk on a background thread.
+/**
+ * Dumps are queued with push() and written in order as PCD and PNG files named after the time they were pushed.
+ * The queue is bounded by the number of dumps and the number of bytes, and the overflow policy decides what happens when it is full.
+ * Queued dumps are still written when the writer is destroyed.
+ */
+class DumpWriter {
+	/// A point cloud and image waiting to be written.
+	struct Dump {
+		std::string name;
+		sensor_msgs::PointCloud2ConstPtr cloud;
+		cv::Mat image;
+		std::size_t bytes;
+	};
+
+public:
+	/// Construct a writer and start its thread.
+	explicit DumpWriter(DumpWriterOptions const & options = DumpWriterOptions());
+
+	DumpWriter(DumpWriter const &) = delete;
+	DumpWriter & operator=(DumpWriter const &) = delete;
+
+	/// Write the remaining queued dumps and stop the thread.
+	~DumpWriter();
+
+	/// Queue a point cloud and image for writing.
+	/**
+	 * The point cloud must not be modified afterwards. The image is shared, not copied.
+	 * \return False if the dump was dropped because the queue was full.
+	 */
+	bool push(sensor_msgs::PointCloud2ConstPtr cloud, cv::Mat const & image);
+
+	/// Get the current statistics.
+	DumpStatistics statistics();
+
+private:
+	/// Check if a dump of the given size fits in the queue. Must be called with the mutex locked.
+	bool fits(std::size_t bytes) const;
+
+	/// Write queued dumps until the writer is stopped and the queue is empty.
+	void run();
+
+	/// Write a single dump to disk.
+	/**
+	 * \throw std::exception if writing failed.
+	 */
+	void write(Dump const & dump);
+
+	/// The options.
+	DumpWriterOptions options;
+
+	/// Mutex protecting the queue and statistics.
+	std::mutex mutex;
+
+	/// Condition signalled when a dump is queued or the writer is stopped.
+	std::condition_variable queued;
+
+	/// Condition signalled when a dump is taken from the queue.
+	std::condition_variable dequeued;
+
+	/// The dumps waiting to be written, oldest first.
+	std::deque<Dump> queue;
+
+	/// The statistics.
+	DumpStatistics stats;
+
+	/// If true, the thread stops once the queue is empty.
+	bool stopping = false;
+
+	/// The thread writing the dumps. Started last, after everything it uses.
+	std::thread thread;
+};
+
+}
@@ -1,8 +1,10 @@
-#include "timestamp.hpp"
+#include "camera_scheduler.hpp"
+#include "dump_writer.hpp"
 
 #include <dr_eigen/ros.hpp>
 #include <dr_eigen/yaml.hpp>
 #include <dr_ensenso/ensenso.hpp>
+#include <dr_ensenso/frame_pool.hpp>
 #include <dr_ensenso/opencv.hpp>
 #include <dr_ensenso/util.hpp>
 #include <dr_param/param.hpp>
@@ -20,20 +22,30 @@
 #include <cv_bridge/cv_bridge.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl_ros/point_cloud.h>
+#include <ros/callback_queue.h>
 #include <ros/ros.h>
 
 #include <geometry_msgs/PoseStamped.h>
 #include <image_transport/image_transport.h>
 #include <sensor_msgs/image_encodings.h>
+#include <sensor_msgs/PointCloud2.h>
 #include <std_srvs/Empty.h>
 
 #include <opencv2/opencv.hpp>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include <boost/bind.hpp>
 #include <boost/optional.hpp>
 
+#include <chrono>
+#include <map>
 #include <memory>
+#include <utility>
+#include <vector>
 
 namespace {
 
@@ -85,7 +97,15 @@ std::unique_ptr<T> make_unique(Args&&... args) {
 
 class EnsensoNode: public ros::NodeHandle {
 public:
-	EnsensoNode() : ros::NodeHandle("~"), image_transport(*this) {
+	/// Construct the driver, using the given node handle for parameters, services and topics.
+	explicit EnsensoNode(ros::NodeHandle const & node = ros::NodeHandle("~")) :
+		ros::NodeHandle(node),
+		scheduler(
+			[this] () { if (ensenso_camera) ensenso_camera->cancelRetrieve(); },
+			[this] () { if (ensenso_camera) ensenso_camera->resumeRetrieve(); }
+		),
+		image_transport(*this)
+	{
 		configure();
 	}
 
@@ -103,11 +123,8 @@ private:
 	ros::NodeHandle const & handle() const { return *this; }
 
 protected:
-	using Point = pcl::PointXYZ;
-	using PointCloud = pcl::PointCloud<Point>;
-
 	struct Data {
-		PointCloud::Ptr cloud;
+		sensor_msgs::PointCloud2Ptr cloud;
 		cv::Mat image;
 	};
 
@@ -118,9 +135,33 @@ protected:
 		param<bool>("publish_cloud", publish_cloud, true);
 		param<bool>("dump_images", dump_images, true);
 		param<bool>("registered", registered, true);
+		param<bool>("textured_cloud", textured_cloud, false);
+		param<bool>("compact_cloud", compact_cloud, false);
+		param<bool>("dense_cloud", point_cloud_options.dense, false);
+		param<int>("cloud_decimation", point_cloud_options.decimation, 1);
+		param<double>("cloud_voxel_size", point_cloud_options.voxel_size, 0.0);
 		param<bool>("connect_monocular", connect_monocular, true);
 		param<bool>("use_frontlight", use_frontlight, true);
 		param<bool>("synced_retrieve", synced_retrieve, false);
+		param<int>("retrieve_timeout", retrieve_timeout, 3000);
+		param<bool>("shared_exposure", shared_exposure, false);
+
+		// start the background writer for dumped data
+		dr::DumpWriterOptions dump_options;
+		dump_options.directory        = camera_data_path;
+		dump_options.max_queued       = dr::getParam(handle(), "dump_queue_size", 4);
+		dump_options.max_queued_bytes = std::size_t(dr::getParam(handle(), "dump_queue_megabytes", 512)) * 1024 * 1024;
+		std::string dump_overflow = dr::getParam<std::string>(handle(), "dump_overflow", "drop_newest");
+		if (dump_overflow == "drop_newest") {
+			dump_options.overflow = dr::DumpOverflow::drop_newest;
+		} else if (dump_overflow == "drop_oldest") {
+			dump_options.overflow = dr::DumpOverflow::drop_oldest;
+		} else if (dump_overflow == "block") {
+			dump_options.overflow = dr::DumpOverflow::block;
+		} else {
+			throw std::runtime_error("Invalid dump_overflow '" + dump_overflow + "'. Expected 'drop_newest', 'drop_oldest' or 'block'.");
+		}
+		dump_writer = dr::make_unique<dr::DumpWriter>(dump_options);
 
 		// get Ensenso serial
 		serial = dr::getParam<std::string>(handle(), "serial", "");
@@ -154,7 +195,7 @@ protected:
 
 		// activate publishers
 		publishers.calibration = advertise<geometry_msgs::PoseStamped>("calibration", 1, true);
-		publishers.cloud       = advertise<PointCloud>("cloud", 1, true);
+		publishers.cloud       = advertise<sensor_msgs::PointCloud2>("cloud", 1, true);
 		publishers.image       = image_transport.advertise("image", 1, true);
 
 		// load ensenso parameters file
@@ -169,6 +210,19 @@ protected:
 			}
 		}
 
+		// load named capture profiles, mapping profile names to parameter files
+		std::map<std::string, std::string> capture_profiles;
+		handle().getParam("capture_profiles", capture_profiles);
+		for (std::pair<std::string const, std::string> const & profile : capture_profiles) {
+			try {
+				if (!ensenso_camera->loadCaptureProfile(profile.first, profile.second)) {
+					ROS_ERROR_STREAM("Failed to load capture profile '" << profile.first << "'. File path: " << profile.second);
+				}
+			} catch (dr::NxError const & e) {
+				ROS_ERROR_STREAM("Failed to load capture profile '" << profile.first << "'. " << e.what());
+			}
+		}
+
 		// load monocular parameters file
 		std::string monocular_param_file = dr::getParam<std::string>(handle(), "monocular_param_file", "");
 		if (monocular_param_file != "") {
@@ -197,29 +251,85 @@ protected:
 		// start publish calibration timer
 		double calibration_timer_rate = dr::getParam(handle(), "calibration_timer_rate", -1.0);
 		if (calibration_timer_rate > 0) {
-			publish_calibration_timer = createTimer(ros::Duration(calibration_timer_rate), &EnsensoNode::publishCalibration, this);
+			publish_calibration_timer = createTimer(ros::TimerOptions(ros::Duration(calibration_timer_rate), boost::bind(&EnsensoNode::publishCalibration, this, _1), &calibration_queue));
 		}
 
 		// start image publishing timer
 		double publish_images_rate = dr::getParam(handle(), "publish_images_rate", 30.0);
 		if (publish_images_rate > 0) {
-			publish_images_timer = createTimer(ros::Rate(publish_images_rate), &EnsensoNode::publishImage, this);
+			publish_images_timer = createTimer(ros::TimerOptions(ros::Rate(publish_images_rate).expectedCycleTime(), boost::bind(&EnsensoNode::publishImage, this, _1), &image_queue));
+		}
+
+		// start cloud streaming timer, sharing the thread of image publishing since previews can not use the camera at the same time anyway
+		double publish_cloud_rate = dr::getParam(handle(), "publish_cloud_rate", 0.0);
+		if (publish_cloud_rate > 0) {
+			publish_cloud_timer = createTimer(ros::TimerOptions(ros::Rate(publish_cloud_rate).expectedCycleTime(), boost::bind(&EnsensoNode::publishCloud, this, _1), &image_queue));
+		}
+
+		// use a dedicated thread pool for point cloud conversion if requested
+		int conversion_threads = dr::getParam(handle(), "conversion_threads", 0);
+		if (conversion_threads > 0) ensenso_camera->setConversionThreads(conversion_threads);
+
+		// limit stereo matching to a box in the workspace, given as [min_x, min_y, min_z, max_x, max_y, max_z] in meters
+		std::vector<double> volume;
+		if (handle().getParam("workspace_volume", volume)) {
+			if (volume.size() == 6) {
+				workspace_volume = Eigen::AlignedBox3d(Eigen::Vector3d(volume[0], volume[1], volume[2]), Eigen::Vector3d(volume[3], volume[4], volume[5]));
+				applyWorkspaceVolume();
+			} else {
+				ROS_ERROR_STREAM("Ignoring workspace volume with " << volume.size() << " values, expected 6.");
+			}
+		}
+
+		// limit the disparity map to the region around the valid points of previous frames if requested
+		// only unregistered point clouds tell where the valid points are, so this does not work with registered point clouds
+		if (dr::getParam(handle(), "adaptive_roi", false) && registered) {
+			ROS_WARN_STREAM("The adaptive_roi parameter requires registered to be false. Not using an adaptive region of interest.");
+		} else if (dr::getParam(handle(), "adaptive_roi", false)) {
+			dr::AdaptiveRoiOptions adaptive_roi;
+			adaptive_roi.margin           = dr::getParam(handle(), "adaptive_roi_margin", adaptive_roi.margin);
+			adaptive_roi.refresh_interval = dr::getParam(handle(), "adaptive_roi_refresh_interval", int(adaptive_roi.refresh_interval));
+			ensenso_camera->setAdaptiveRoi(adaptive_roi);
 		}
 
 		// check if there is an monocular camera connected
 		has_monocular = ensenso_camera->hasMonocular();
+		if (registered && textured_cloud && !compact_cloud && !has_monocular) {
+			ROS_WARN_STREAM("Textured registered point clouds need a monocular camera. Requests for point clouds will fail.");
+		}
 
 		// check if camera really has front light. This will throw an error if it doesn't.
 		if (use_frontlight) ensenso_camera->setFrontLight(false);
 
+		// preallocate images so that publishing images does not allocate
+		try {
+			image_pool.reserve(ensenso_camera->getIntensitySize(), ensenso_camera->getIntensityType());
+		} catch (dr::NxError const & e) {
+			ROS_WARN_STREAM("Failed to determine image size, images will not be preallocated. " << e.what());
+		}
+
+		// publish images and calibration on their own threads, so they never delay service requests
+		image_spinner.reset(new ros::AsyncSpinner(1, &image_queue));
+		calibration_spinner.reset(new ros::AsyncSpinner(1, &calibration_queue));
+		image_spinner->start();
+		calibration_spinner->start();
+
 		ROS_INFO_STREAM("Ensenso opened successfully.");
 	}
 
 	void publishImage(ros::TimerEvent const &) {
 		if (publishers.image.getNumSubscribers() == 0) return;
 
+		// skip this image if the camera is busy with a request
+		dr::CameraScheduler::Access access = scheduler.preview();
+		if (!access) return;
+
 		// capture only image
-		capture(false, true);
+		if (!capture(false, true)) return;
+
+		// skip this image if no new image was retrieved, rather than publishing the previous one
+		cv::Mat image = getImage(!has_monocular);
+		if (image.empty()) return;
 
 		// create a header
 		std_msgs::Header header;
@@ -230,112 +340,166 @@ protected:
 		cv_bridge::CvImage cv_image(
 			header,
 			has_monocular ? sensor_msgs::image_encodings::BGR8 : sensor_msgs::image_encodings::MONO8,
-			getImage(!has_monocular)
+			image
 		);
 
 		// publish the image
 		publishers.image.publish(cv_image.toImageMsg());
 	}
 
-	PointCloud::Ptr getPointCloud() {
-		PointCloud::Ptr cloud(new PointCloud);
-		try {
-			if (registered) {
-				ensenso_camera->loadRegisteredPointCloud(*cloud, cv::Rect(), false);
-			} else {
-				ensenso_camera->loadPointCloud(*cloud, cv::Rect(), false);
-			}
-		} catch (dr::NxError const & e) {
-			ROS_ERROR_STREAM("Failed to retrieve PointCloud. " << e.what());
-			return nullptr;
-		}
-		cloud->header.frame_id = camera_frame;
+	void publishCloud(ros::TimerEvent const &) {
+		// without subscribers, do not capture or compute a disparity map at all
+		if (publishers.cloud.getNumSubscribers() == 0) return;
 
-		return cloud;
+		// skip this cloud if the camera is busy with a request
+		dr::CameraScheduler::Access access = scheduler.preview();
+		if (!access) return;
+
+		boost::optional<Data> data = getData(false);
+		if (!data) return;
+
+		publishers.cloud.publish(sensor_msgs::PointCloud2ConstPtr(data->cloud));
 	}
 
+	/// Load the intensity image, optionally capturing a new one.
+	/**
+	 * \return The image, or an empty image if no new image was retrieved.
+	 */
 	cv::Mat getImage(bool capture) {
-		// get a grayscale image? then enable frontlight
-		int flex_view;
-		if (!has_monocular && capture) {
-			flex_view = ensenso_camera->flexView();
-			ensenso_camera->setFlexView(0);
-			ensenso_camera->setProjector(false);
-			if (use_frontlight) ensenso_camera->setFrontLight(true);
-		}
-
-		cv::Mat image;
+		cv::Mat image = image_pool.get();
 		try {
-			ensenso_camera->loadIntensity(image, capture);
+			// get a grayscale image? then enable frontlight, restoring the previous settings afterwards
+			boost::optional<dr::ScopedCaptureSettings> scoped_settings;
+			if (!has_monocular && capture) {
+				dr::CaptureSettings settings;
+				settings.flex_view = -1;
+				settings.projector = false;
+				if (use_frontlight) settings.front_light = true;
+				scoped_settings.emplace(*ensenso_camera, settings);
+			}
+
+			if (!checkRetrieve(ensenso_camera->loadIntensity(image, capture, retrieve_timeout))) return cv::Mat();
 		} catch (dr::NxError const & e) {
 			ROS_ERROR_STREAM("Failed to retrieve image. " << e.what());
 			return cv::Mat();
 		}
 
-		// restore settings
-		if (!has_monocular && capture) {
-			if (use_frontlight) ensenso_camera->setFrontLight(false);
-			ensenso_camera->setProjector(true);
-			if (flex_view > 0) {
-				ensenso_camera->setFlexView(flex_view);
-			}
-		}
-
 		return image;
 	}
 
-	void dumpData(PointCloud::ConstPtr point_cloud, cv::Mat const & image) {
-		// create path if it does not exist
-		boost::filesystem::path path(camera_data_path);
-		if (!boost::filesystem::is_directory(path)) {
-			boost::filesystem::create_directory(camera_data_path);
+	/// Log the outcome of retrieving image data.
+	/**
+	 * \return True if image data was retrieved.
+	 */
+	bool checkRetrieve(dr::RetrieveResult const & result) {
+		switch (result.status) {
+			case dr::RetrieveResult::Status::retrieved:
+				ROS_DEBUG_STREAM("Retrieved image data after " << result.waited.count() << " us.");
+				return true;
+			case dr::RetrieveResult::Status::not_triggered:
+				ROS_ERROR_STREAM("Failed to retrieve image data. The camera could not be triggered.");
+				return false;
+			case dr::RetrieveResult::Status::timed_out:
+				ROS_ERROR_STREAM("Failed to retrieve image data. Timed out after " << result.waited.count() / 1000 << " ms.");
+				return false;
+			case dr::RetrieveResult::Status::cancelled:
+				// only image publishing is cancelled, to make way for service requests
+				ROS_DEBUG_STREAM("Retrieving image data was cancelled after " << result.waited.count() / 1000 << " ms.");
+				return false;
 		}
-
-		std::string time_string = getTimeString();
-
-		pcl::io::savePCDFileBinary(camera_data_path + "/" + time_string + "_cloud.pcd", *point_cloud);
-		cv::imwrite(camera_data_path + "/" + time_string + "_image.png", image);
+		return false;
 	}
 
 	bool capture(bool stereo, bool monocular) {
 		// retrieve image data
 		try {
-			if (!ensenso_camera->retrieve(true, 3000, stereo, has_monocular && monocular)) {
-				ROS_ERROR_STREAM("Failed to retrieve image data.");
-				return false;
-			}
+			std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(retrieve_timeout);
+			return checkRetrieve(ensenso_camera->retrieveUntil(deadline, true, stereo, has_monocular && monocular));
 		} catch (dr::NxError const & e) {
 			ROS_ERROR_STREAM("Failed to retrieve image data. " << e.what());
 			return false;
 		}
-
-		return true;
 	}
 
-	boost::optional<Data> getData() {
-		cv::Mat image;
+	/// Capture a point cloud and optionally an intensity image.
+	/**
+	 * \param intensity If false, no intensity image is captured or converted and the image of the returned data is empty.
+	 */
+	boost::optional<Data> getData(bool intensity = true) {
+		std::uint64_t tree_accesses = dr::nxTreeAccesses();
+
+		// textured clouds use the monocular color image when registered and the rectified left image otherwise
+		dr::FrameOptions options;
+		options.cloud           = point_cloud_options;
+		options.encoding        = compact_cloud ? dr::CloudEncoding::compact : textured_cloud ? dr::CloudEncoding::textured : dr::CloudEncoding::xyz;
+		options.registered      = registered;
+		options.intensity       = intensity;
+		options.shared_exposure = shared_exposure;
+		options.front_light     = use_frontlight;
+		options.synced          = synced_retrieve;
+		options.timeout         = retrieve_timeout;
+
+		// convert into the buffers of a recycled message, so a steady stream of frames does not allocate
+		sensor_msgs::PointCloud2Ptr cloud = cloud_pool.get();
+		dr::Frame frame;
+		std::swap(frame.cloud, *cloud);
+		if (intensity) frame.intensity = image_pool.get();
+
+		bool retrieved = false;
+		try {
+			retrieved = checkRetrieve(ensenso_camera->getFrame(frame, options));
+		} catch (std::runtime_error const & e) {
+			ROS_ERROR_STREAM("Failed to capture frame. " << e.what());
+		}
 
-		// when using an monocular, capture both simultaneously
-		if (has_monocular) {
-			if (!capture(synced_retrieve, true)) return boost::none;
+		// hand the buffers back to the pooled message, also on failure so they are not lost
+		std::swap(frame.cloud, *cloud);
+		if (!retrieved) return boost::none;
+		cloud->header.frame_id = camera_frame;
 
-			// capture stereo image after monocular image if we don't synchronize the triggers
-			if (!synced_retrieve && !capture(true, false)) return boost::none;
-			image = getImage(false);
+		dr::StageTimings const & timings = frame.timings;
+		ROS_DEBUG_STREAM("Captured frame with " << frame.captures << " captures and " << dr::nxTreeAccesses() - tree_accesses << " NxLib tree accesses."
+			<< " Stage timings [us]:"
+			<< " retrieve " << timings.retrieve.count()
+			<< ", rectify " << timings.rectify.count()
+			<< ", disparity " << timings.disparity.count()
+			<< ", point map " << timings.point_map.count()
+			<< ", conversion " << timings.conversion.count()
+		);
+		return Data{cloud, frame.intensity};
+	}
 
-		// when not using an monocular, capture image first
-		} else {
-			image = getImage(true);
-			if (!capture(true, false)) return boost::none;
+	bool onGetData(dr_ensenso_msgs::GetCameraData::Request & req, dr_ensenso_msgs::GetCameraData::Response & res) {
+		dr::CameraScheduler::Access access = scheduler.request();
+		if (!req.profile.empty()) {
+			try {
+				ensenso_camera->activateCaptureProfile(req.profile);
+			} catch (std::runtime_error const & e) {
+				ROS_ERROR_STREAM("Failed to activate capture profile '" << req.profile << "'. " << e.what());
+				return false;
+			}
 		}
 
-		return Data{getPointCloud(), image};
-	}
-
-	bool onGetData(dr_ensenso_msgs::GetCameraData::Request &, dr_ensenso_msgs::GetCameraData::Response & res) {
 		boost::optional<Data> data = getData();
 		if (!data) return false;
-		pcl::toROSMsg(*data->cloud, res.point_cloud);
+
+		// queue image and point cloud for writing to disk
+		if (dump_images) dump_writer->push(data->cloud, data->image);
+
+		// publish point cloud if requested
+		// the message is shared with intra-process subscribers without serializing, so it must not be modified afterwards
+		if (publish_cloud) {
+			publishers.cloud.publish(sensor_msgs::PointCloud2ConstPtr(data->cloud));
+		}
+
+		// the dump writer and subscribers may still hold the point cloud, so copy it into the response in that case
+		if (dump_images || publish_cloud) {
+			res.point_cloud = *data->cloud;
+		} else {
+			// move the point cloud into the response to avoid copying the point data
+			// the response must own its data anyway, so the pooled message allocating a new buffer next time costs no more than a copy
+			res.point_cloud = std::move(*data->cloud);
+		}
 
 		// get the image
 		cv_bridge::CvImage cv_image(
@@ -345,25 +509,18 @@ protected:
 		);
 		res.color = *cv_image.toImageMsg();
 
-		// store image and point cloud
-		if (dump_images) dumpData(data->cloud, data->image);
-
-		// publish point cloud if requested
-		if (publish_cloud) {
-			publishers.cloud.publish(data->cloud);
-		}
-
 		return true;
 	}
 
 	bool onDumpData(std_srvs::Empty::Request &, std_srvs::Empty::Response &) {
+		dr::CameraScheduler::Access access = scheduler.request();
 		boost::optional<Data> data = getData();
 		if (!data) return false;
-		dumpData(data->cloud, data->image);
-		return true;
+		return dump_writer->push(data->cloud, data->image);
 	}
 
 	bool onDetectCalibrationPattern(dr_ensenso_msgs::DetectCalibrationPattern::Request & req, dr_ensenso_msgs::DetectCalibrationPattern::Response & res) {
+		dr::CameraScheduler::Access access = scheduler.request();
 		if (req.samples == 0) {
 			ROS_ERROR_STREAM("Unable to get pattern pose. Number of samples is set to 0.");
 			return false;
@@ -380,6 +537,7 @@ protected:
 	}
 
 	bool onInitializeCalibration(dr_ensenso_msgs::InitializeCalibration::Request & req, dr_ensenso_msgs::InitializeCalibration::Response &) {
+		dr::CameraScheduler::Access access = scheduler.request();
 		try {
 			ensenso_camera->discardCalibrationPatterns();
 			ensenso_camera->clearWorkspaceCalibration();
@@ -421,6 +579,7 @@ protected:
 	}
 
 	bool onRecordCalibration(dr_ensenso_msgs::SendPose::Request & req, dr_ensenso_msgs::SendPose::Response &) {
+		dr::CameraScheduler::Access access = scheduler.request();
 		// check for proper initialization
 		if (moving_frame == "" || fixed_frame == "") {
 			ROS_ERROR_STREAM("No calibration frame provided.");
@@ -443,6 +602,7 @@ protected:
 	}
 
 	bool onFinalizeCalibration(dr_ensenso_msgs::FinalizeCalibration::Request &, dr_ensenso_msgs::FinalizeCalibration::Response & res) {
+		dr::CameraScheduler::Access access = scheduler.request();
 		// check for proper initialization
 		if (moving_frame == "" || fixed_frame == "") {
 			ROS_ERROR_STREAM("No calibration frame provided.");
@@ -477,27 +637,43 @@ protected:
 		return true;
 	}
 
+	/// Limit stereo matching to the configured workspace volume, if any. Needs to be repeated when the workspace calibration changes.
+	void applyWorkspaceVolume() {
+		if (!workspace_volume) return;
+		try {
+			cv::Rect roi = ensenso_camera->setWorkspaceVolume(*workspace_volume);
+			ROS_INFO_STREAM("Limited stereo matching to the workspace volume, region of interest: " << roi);
+		} catch (std::runtime_error const & e) {
+			ROS_ERROR_STREAM("Failed to set workspace volume. " << e.what());
+		}
+	}
+
 	bool onSetWorkspaceCalibration(dr_ensenso_msgs::SendPoseStamped::Request & req, dr_ensenso_msgs::SendPoseStamped::Response &) {
+		dr::CameraScheduler::Access access = scheduler.request();
 		try {
 			ensenso_camera->setWorkspaceCalibration(dr::toEigen(req.data.pose), req.data.header.frame_id, Eigen::Isometry3d::Identity());
 		} catch (dr::NxError const & e) {
 			ROS_ERROR_STREAM("Failed to set workspace calibration: " << e.what());
 			return false;
 		}
+		applyWorkspaceVolume();
 		return true;
 	}
 
 	bool onClearWorkspaceCalibration(std_srvs::Empty::Request &, std_srvs::Empty::Response &) {
+		dr::CameraScheduler::Access access = scheduler.request();
 		try {
 			ensenso_camera->clearWorkspaceCalibration();
 		} catch (dr::NxError const & e) {
 			ROS_ERROR_STREAM("Failed to clear workspace calibration: " << e.what());
 			return false;
 		}
+		applyWorkspaceVolume();
 		return true;
 	}
 
 	bool onCalibrateWorkspace(dr_ensenso_msgs::Calibrate::Request & req, dr_ensenso_msgs::Calibrate::Response &) {
+		dr::CameraScheduler::Access access = scheduler.request();
 		ROS_INFO_STREAM("Performing workspace calibration.");
 
 		if (req.frame_id.empty()) {
@@ -514,10 +690,12 @@ protected:
 			ROS_ERROR_STREAM("Failed to calibrate camera pose. " << e.what());
 			return false;
 		}
+		applyWorkspaceVolume();
 		return true;
 	}
 
 	bool onStoreWorkspaceCalibration(std_srvs::Empty::Request &, std_srvs::Empty::Response &) {
+		dr::CameraScheduler::Access access = scheduler.request();
 		try {
 			ensenso_camera->storeWorkspaceCalibration();
 		} catch (dr::NxError const & e) {
@@ -558,10 +736,12 @@ protected:
 	}
 
 	void publishCalibration(ros::TimerEvent const &) {
+		// this runs without access to the camera, so a service may clear the calibration at any time: read it only once
 		geometry_msgs::PoseStamped pose;
+		boost::optional<Eigen::Isometry3d> calibration = ensenso_camera->getWorkspaceCalibration();
 		std::string frame = ensenso_camera->getWorkspaceCalibrationFrame();
-		if (!frame.empty()) {
-			pose = dr::toRosPoseStamped(ensenso_camera->getWorkspaceCalibration()->inverse(), frame, ros::Time::now());
+		if (calibration && !frame.empty()) {
+			pose = dr::toRosPoseStamped(calibration->inverse(), frame, ros::Time::now());
 		} else {
 			pose = dr::toRosPoseStamped(Eigen::Isometry3d::Identity(), "", ros::Time::now());
 		}
@@ -572,6 +752,9 @@ protected:
 	/// The wrapper for the Ensenso stereo camera.
 	std::unique_ptr<dr::Ensenso> ensenso_camera;
 
+	/// Scheduler for access to the camera by service requests and image publishing.
+	dr::CameraScheduler scheduler;
+
 	struct {
 		/// Service server for supplying point clouds and images.
 		ros::ServiceServer camera_data;
@@ -610,12 +793,21 @@ protected:
 	/// Object for handling transportation of images.
 	image_transport::ImageTransport image_transport;
 
+	/// Callback queue for image publishing, so a slow image does not delay service requests.
+	ros::CallbackQueue image_queue;
+
+	/// Callback queue for calibration publishing.
+	ros::CallbackQueue calibration_queue;
+
 	/// Timer to trigger calibration publishing.
 	ros::Timer publish_calibration_timer;
 
 	/// Timer to trigger image publishing.
 	ros::Timer publish_images_timer;
 
+	/// Timer to trigger point cloud streaming.
+	ros::Timer publish_cloud_timer;
+
 	struct Publishers {
 		/// Publisher for the calibration result.
 		ros::Publisher calibration;
@@ -651,12 +843,30 @@ protected:
 	/// If true, registers the point clouds.
 	bool registered;
 
+	/// If true, adds intensity (or color when registered) to the point clouds.
+	bool textured_cloud;
+
+	/// If true, sends point clouds with INT16 millimeter coordinates instead of FLOAT32 meters. Takes precedence over textured_cloud.
+	bool compact_cloud;
+
+	/// Options for converting point maps to point clouds.
+	dr::PointCloudOptions point_cloud_options;
+
+	/// Pool of recycled intensity images.
+	dr::ImagePool image_pool;
+
+	/// Pool of recycled point cloud messages, with room for the latched message, queued dumps and the message being filled.
+	dr::PointCloud2Pool cloud_pool{6};
+
 	// Guess of the camera pose relative to gripper (for moving camera) or relative to robot origin (for static camera).
 	boost::optional<Eigen::Isometry3d> camera_guess;
 
 	// Guess of the calibration pattern pose relative to gripper (for static camera) or relative to robot origin (for moving camera).
 	boost::optional<Eigen::Isometry3d> pattern_guess;
 
+	/// Box in the calibrated frame to limit stereo matching to.
+	boost::optional<Eigen::AlignedBox3d> workspace_volume;
+
 	/// Used in calibration. Determines if the camera is moving (eye in hand) or static.
 	bool camera_moving;
 
@@ -677,13 +887,34 @@ protected:
 
 	/// If true, retrieves the monocular camera and Ensenso simultaneously. A hardware trigger is advised to remove the projector from the uEye image.
 	bool synced_retrieve;
+
+	/// Time in milliseconds to wait for image data after triggering the camera.
+	int retrieve_timeout;
+
+	/// If true and there is no monocular camera, takes the image from the same exposure as the point cloud instead of a separate capture without projector.
+	bool shared_exposure;
+
+	/// Writer for dumped images and point clouds.
+	std::unique_ptr<dr::DumpWriter> dump_writer;
+
+	/// Spinner for the image publishing queue. Stopped first on destruction, before anything the callbacks use.
+	std::unique_ptr<ros::AsyncSpinner> image_spinner;
+
+	/// Spinner for the calibration publishing queue. Stopped first on destruction, before anything the callbacks use.
+	std::unique_ptr<ros::AsyncSpinner> calibration_spinner;
 };
 
-}
+/// Nodelet running the Ensenso driver, so nodelets in the same manager receive clouds and images without serialization.
+class EnsensoNodelet: public nodelet::Nodelet {
+	/// The driver, created when the nodelet is initialized.
+	std::unique_ptr<EnsensoNode> node;
+
+	void onInit() override {
+		// services are handled on the single threaded queue of the nodelet, image and calibration publishing have their own threads
+		node = make_unique<EnsensoNode>(getPrivateNodeHandle());
+	}
+};
 
-int main(int argc, char ** argv) {
-	ros::init(argc, argv, "ensenso");
-	dr::EnsensoNode node;
-	ros::spin();
 }
 
+PLUGINLIB_EXPORT_CLASS(dr::EnsensoNodelet, nodelet::Nodelet)
@@ -0,0 +1,19 @@
+#include <nodelet/loader.h>
+#include <ros/ros.h>
+
+#include <string>
+#include <vector>
+
+int main(int argc, char ** argv) {
+	ros::init(argc, argv, "ensenso");
+
+	// load the driver as a nodelet under the name of this node, so it reads its parameters from the private namespace as before
+	nodelet::Loader loader(false);
+	std::vector<std::string> arguments(argv + 1, argv + argc);
+	if (!loader.load(ros::this_node::getName(), "dr_ensenso_node/ensenso", ros::names::getRemappings(), arguments)) {
+		ROS_FATAL_STREAM("Failed to load the Ensenso nodelet.");
+		return 1;
+	}
+
+	ros::spin();
+}